@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+// Barnes-Hut quadtree over the unit square. The tree is rebuilt from scratch
+// every step, nodes live in one growable pool and the four children of a node
+// are always stored next to each other.
+
+#define BH_MAX_DEPTH 32
+#define BH_NO_CHILD -1
+
+struct bh_node_s {
+    float mass;
+    float mx;       // mass weighted x sum, centre of mass after BH_finalize
+    float my;
+    float cx;       // centre of the square covered by the node
+    float cy;
+    float half;     // half of the side length
+    int child;      // index of the first of four children or BH_NO_CHILD
+    int body;       // particle stored in a leaf, -1 for empty or merged leaves
+    int count;
+};
+
+typedef struct bh_node_s bh_node;
+
+bh_node *bh_nodes;
+int bh_node_count;
+int bh_node_capacity;
+
+int BH_new_node(float cx, float cy, float half){
+    if (bh_node_count == bh_node_capacity) {
+        bh_node_capacity = bh_node_capacity ? bh_node_capacity * 2 : 1024;
+        bh_nodes = realloc(bh_nodes, sizeof(bh_node) * bh_node_capacity);
+        if (bh_nodes == NULL) {
+            fprintf(stderr, "Barnes-Hut: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    bh_node *n = &bh_nodes[bh_node_count];
+    n->mass = 0;
+    n->mx = 0;
+    n->my = 0;
+    n->cx = cx;
+    n->cy = cy;
+    n->half = half;
+    n->child = BH_NO_CHILD;
+    n->body = -1;
+    n->count = 0;
+    return bh_node_count++;
+}
+
+int BH_quadrant(const bh_node *n, const vectorf *p){
+    return (p->x >= n->cx) + 2 * (p->y >= n->cy);
+}
+
+void BH_subdivide(int node){
+    float h = bh_nodes[node].half / 2;
+    float cx = bh_nodes[node].cx;
+    float cy = bh_nodes[node].cy;
+
+    // BH_new_node may move the pool, so no pointers are held across it
+    int first = BH_new_node(cx - h, cy - h, h);
+    BH_new_node(cx + h, cy - h, h);
+    BH_new_node(cx - h, cy + h, h);
+    BH_new_node(cx + h, cy + h, h);
+    bh_nodes[node].child = first;
+}
+
+void BH_insert(const particle_store *s, int index){
+    vectorf position = PS_position(s, index);
+    const vectorf *p = &position;
+    float mass = s->m[index];
+    int node = 0;
+
+    for (int depth = 0;; depth++) {
+        bh_node *n = &bh_nodes[node];
+
+        if (n->child == BH_NO_CHILD) {
+            if (n->count == 0 || depth == BH_MAX_DEPTH) {
+                n->body = n->count == 0 ? index : -1;
+                n->mass += mass;
+                n->mx += p->x * mass;
+                n->my += p->y * mass;
+                n->count++;
+                return;
+            }
+
+            // push the resident body one level down before descending
+            int resident = n->body;
+            vectorf resident_position = PS_position(s, resident);
+            BH_subdivide(node);
+            n = &bh_nodes[node];
+            bh_node *c = &bh_nodes[n->child + BH_quadrant(n, &resident_position)];
+            c->body = resident;
+            c->mass = n->mass;
+            c->mx = n->mx;
+            c->my = n->my;
+            c->count = 1;
+            n->body = -1;
+        }
+
+        n->mass += mass;
+        n->mx += p->x * mass;
+        n->my += p->y * mass;
+        n->count++;
+        node = n->child + BH_quadrant(n, p);
+    }
+}
+
+void BH_finalize(){
+    for (int i = 0; i < bh_node_count; i++) {
+        bh_node *n = &bh_nodes[i];
+        if (n->mass > 0) {
+            n->mx /= n->mass;
+            n->my /= n->mass;
+        }
+    }
+}
+
+void BH_build(const particle_store *s){
+    bh_node_count = 0;
+    BH_new_node(0.5f, 0.5f, 0.5f);
+    for (int i = 0; i < s->count; i++) {
+        BH_insert(s, i);
+    }
+    BH_finalize();
+}
+
+vectorf BH_force_on(const particle_store *s, int index, float theta){
+    vectorf position = PS_position(s, index);
+    const vectorf *p = &position;
+    vectorf total = {0, 0};
+    int stack[4 * BH_MAX_DEPTH + 4];
+    int top = 0;
+
+    stack[top++] = 0;
+    while (top > 0) {
+        const bh_node *n = &bh_nodes[stack[--top]];
+        if (n->mass == 0 || n->body == index)
+            continue;
+
+        vectorf com = {n->mx, n->my};
+        if (n->child != BH_NO_CHILD) {
+            float dx = com.x - p->x;
+            float dy = com.y - p->y;
+            float size = 2 * n->half;
+            // opening criterion s / d < theta, squared to skip the sqrt
+            if (size * size >= theta * theta * (dx * dx + dy * dy)) {
+                for (int c = 0; c < 4; c++) {
+                    stack[top++] = n->child + c;
+                }
+                continue;
+            }
+        }
+
+        vectorf f = calculate_force_cpu(&com, p, n->mass);
+        vector_add(&total, &f);
+    }
+    return total;
+}
+
+struct bh_walk_job_s {
+    particle_store *particles;
+    float theta;
+};
+
+typedef struct bh_walk_job_s bh_walk_job;
+
+void BH_walk_range(int begin, int end, int thread, void *ctx){
+    bh_walk_job *job = ctx;
+    for (int i = begin; i < end; i++) {
+        vectorf f = BH_force_on(job->particles, i, job->theta);
+        job->particles->fx[i] = f.x;
+        job->particles->fy[i] = f.y;
+    }
+}
+
+// The tree is built serially, the walks only read it and are split over the
+// worker threads.
+void BH_calculate_forces(particle_store *s, float theta){
+    BH_build(s);
+    bh_walk_job job;
+    job.particles = s;
+    job.theta = theta;
+    parallel_for(s->count, BH_walk_range, &job);
+}
+
+void BH_clear(){
+    free(bh_nodes);
+    bh_nodes = NULL;
+    bh_node_count = 0;
+    bh_node_capacity = 0;
+}
@@ -1,4 +1,14 @@
 
+// The force law and the grid come in as -D options when the host builds a
+// specialised variant, see PX_specialize. Without them every kernel reads
+// its arguments.
+#ifndef FORCE_K
+#define FORCE_K 10.0f
+#endif
+#ifndef FORCE_MIN_DIST
+#define FORCE_MIN_DIST 0.0000001f
+#endif
+
 float distancePow2(__global const float2 *p1, __global const float2 *p2) {
     return pow(p1->x - p2->x, 2) + pow(p1->y - p2->y, 2);
 }
@@ -10,12 +20,12 @@ float2 calculate_force_gpu(__global float2 *p1, __global float2 *p2, float mass)
     float2 force_vector;
     float dist = distance(p1, p2);
 
-    if (dist < 0.0000001){
+    if (dist < FORCE_MIN_DIST){
         force_vector.x = 0;
         force_vector.y = 0;
         return force_vector;    
     }
-    float force = 10 / (dist * dist);
+    float force = FORCE_K * mass / (dist * dist);
     float dx = p1->x - p2->x;
     float dy = p1->y - p2->y;
 
@@ -26,29 +36,447 @@ float2 calculate_force_gpu(__global float2 *p1, __global float2 *p2, float mass)
 }
 
 
-__kernel void calculate_force(
+// levels holds (cols, rows, offset) of every level of the tile hierarchy,
+// finest first. At each level a tile interacts with the children of its
+// parent's neighbours that are not its own neighbours, those are handled one
+// level finer. The finest level also takes the neighbours themselves.
+__kernel void calculate_force_hierarchical(
         __global float2 *tiles,
         __global float *masses,
+        __global int4 *levels,
+        int level_count,
+        __global float2 *out_forces
+    ){
+    int4 fine = levels[0];
+#ifdef GRID_COLS
+    fine.x = GRID_COLS;
+    fine.y = GRID_ROWS;
+#endif
+#ifdef LEVEL_COUNT
+    level_count = LEVEL_COUNT;
+#endif
+    int id = get_global_id(0);
+    if(id >= fine.x * fine.y)
+        return;
+
+    int row = id / fine.x;
+    int col = id % fine.x;
+    float2 force = (float2)(0, 0);
+
+    for (int l = level_count - 1; l >= 0; l--) {
+        int4 level = levels[l];
+        int r = row >> l;
+        int c = col >> l;
+        int r0 = 0, r1 = level.y - 1, c0 = 0, c1 = level.x - 1;
+
+        if (l < level_count - 1) {
+            int pr = r >> 1;
+            int pc = c >> 1;
+            r0 = max(2 * (pr - 1), 0);
+            r1 = min(2 * (pr + 1) + 1, level.y - 1);
+            c0 = max(2 * (pc - 1), 0);
+            c1 = min(2 * (pc + 1) + 1, level.x - 1);
+        }
+
+        for (int rr = r0; rr <= r1; rr++) {
+            for (int cc = c0; cc <= c1; cc++) {
+                if (l > 0 && abs(rr - r) <= 1 && abs(cc - c) <= 1)
+                    continue;
+                int k = level.z + rr * level.x + cc;
+                force += calculate_force_gpu(&tiles[k], &tiles[id], masses[k]);
+            }
+        }
+    }
+    out_forces[id] = force;
+}
+
+
+// Pull towards p1 per unit of source mass, calculate_force_gpu without the
+// mass so one evaluation serves both sides of a pair.
+float2 pair_term(float2 p1, float2 p2){
+    float2 d = p1 - p2;
+    float dist = length(d);
+    if (dist < FORCE_MIN_DIST)
+        return (float2)(0, 0);
+    return FORCE_K * d / (dist * dist * dist);
+}
+
+// All pairs over level 0. A work-group walks the tiles in blocks of its own
+// size: every item stages one tile of the block in local memory, then each
+// accumulates the whole block against its own tile in registers. Items
+// past count still load and synchronise, they only skip the write.
+__kernel void calculate_force(
+        __global const float2 *tiles,
+        __global const float *masses,
         int max_col,
         int max_row,
+        __global float2 *out_forces,
+        __local float2 *j_pos,
+        __local float *j_mass
+    ){
+#ifdef GRID_COLS
+    max_col = GRID_COLS;
+    max_row = GRID_ROWS;
+#endif
+    int count = max_col * max_row;
+    int id = get_global_id(0);
+    int lid = get_local_id(0);
+    int size = get_local_size(0);
+    float2 pi = id < count ? tiles[id] : (float2)(0, 0);
+
+    float2 force = (float2)(0, 0);
+    for (int base = 0; base < count; base += size) {
+        int j = base + lid;
+        j_pos[lid] = j < count ? tiles[j] : (float2)(0, 0);
+        j_mass[lid] = j < count ? masses[j] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+#ifdef FLAT_UNROLL
+        // set by the autotuner, see PX_tune
+        #pragma unroll FLAT_UNROLL
+#endif
+        for (int n = 0; n < size; n++) {
+            force += pair_term(j_pos[n], pi) * j_mass[n];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (id < count)
+        out_forces[id] = force;
+}
+
+// All pairs, each unordered pair evaluated once. Work-group (bi, bj) with
+// bi <= bj takes block bi of tiles as i and block bj as j and writes
+// what block bj contributes to block bi into partial_forces row bj, and the
+// opposite contributions into row bi. Work-item l visits j slot (l + s) % S
+// at step s, so no two items accumulate into the same j at once.
+// reduce_partial_forces sums the rows afterwards.
+__kernel void calculate_force_symmetric(
+        __global const float2 *tiles,
+        __global const float *masses,
+        int count,
+        __global float2 *partial_forces,
+        __local float2 *j_pos,
+        __local float *j_mass,
+        __local float2 *j_acc
+    ){
+    int bi = get_group_id(0);
+    int bj = get_group_id(1);
+    if (bi > bj)
+        return;
+
+    int lid = get_local_id(0);
+    int size = get_local_size(0);
+    int i = bi * size + lid;
+    int j = bj * size + lid;
+
+    float2 pi = i < count ? tiles[i] : (float2)(0, 0);
+    float mi = i < count ? masses[i] : 0;
+    j_pos[lid] = j < count ? tiles[j] : (float2)(0, 0);
+    j_mass[lid] = j < count ? masses[j] : 0;
+    j_acc[lid] = (float2)(0, 0);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    float2 acc = (float2)(0, 0);
+    if (bi == bj) {
+        for (int n = 0; n < size; n++) {
+            acc += pair_term(j_pos[n], pi) * j_mass[n];
+        }
+    } else {
+        for (int s = 0; s < size; s++) {
+            int n = (lid + s) % size;
+            float2 term = pair_term(j_pos[n], pi);
+            acc += term * j_mass[n];
+            j_acc[n] -= term * mi;
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+    }
+
+    if (i < count)
+        partial_forces[bj * count + i] = acc;
+    if (bi != bj && j < count)
+        partial_forces[bi * count + j] = j_acc[lid];
+}
+
+__kernel void reduce_partial_forces(
+        __global const float2 *partial_forces,
+        int block_count,
+        int count,
         __global float2 *out_forces
     ){
-    int i = get_global_id(0);
-    int j = get_global_id(1);
+    int id = get_global_id(0);
+    if (id >= count)
+        return;
+
+    float2 force = (float2)(0, 0);
+    for (int b = 0; b < block_count; b++) {
+        force += partial_forces[b * count + id];
+    }
+    out_forces[id] = force;
+}
 
-    if(i >= max_row || j >= max_col)
+// Counting sort of particles into the cols x rows level 0 tiles. The count
+// pass records the tile of every particle and counts the tiles atomically.
+__kernel void bucket_count(
+        __global const float *x,
+        __global const float *y,
+        int count,
+        int cols,
+        int rows,
+        __global int *particle_tiles,
+        volatile __global int *tile_counts
+    ){
+    int id = get_global_id(0);
+    if (id >= count)
         return;
 
-    printf("%d, %d \n", i,j);
+    int col = clamp((int)(clamp(x[id], 0.0f, 1.0f) * cols), 0, cols - 1);
+    int row = clamp((int)(clamp(y[id], 0.0f, 1.0f) * rows), 0, rows - 1);
+    int k = row * cols + col;
+    particle_tiles[id] = k;
+    atomic_inc(&tile_counts[k]);
+}
+
+// Exclusive prefix sum of tile_counts into tile_start, which has one extra
+// entry for the total. Runs as a single work-group: every item scans its own
+// run of tiles and the run totals are scanned in local memory.
+__kernel void bucket_scan(
+        __global const int *tile_counts,
+        int tile_count,
+        __global int *tile_start,
+        __local int *run_totals
+    ){
+    int lid = get_local_id(0);
+    int size = get_local_size(0);
+    int run = (tile_count + size - 1) / size;
+    int first = min(lid * run, tile_count);
+    int last = min(first + run, tile_count);
+
+    int total = 0;
+    for (int k = first; k < last; k++) {
+        total += tile_counts[k];
+    }
+    run_totals[lid] = total;
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-    return;
-    for (int k = 0; k < max_col; k++) {
-        for (int n = 0; n < max_row; n++) {
-            float2 forcev = calculate_force_gpu(
-                &tiles[k * max_col + n], 
-                &tiles[i * max_col + j], 
-                masses[i * max_col + j] + masses[k * max_col + n]);
-            out_forces[i * max_col + j] += forcev;
+    if (lid == 0) {
+        int sum = 0;
+        for (int i = 0; i < size; i++) {
+            int n = run_totals[i];
+            run_totals[i] = sum;
+            sum += n;
         }
+        tile_start[tile_count] = sum;
     }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int offset = run_totals[lid];
+    for (int k = first; k < last; k++) {
+        tile_start[k] = offset;
+        offset += tile_counts[k];
+    }
+}
+
+// Puts every particle in the next free slot of its tile. tile_cursors starts
+// as a copy of tile_start, slots are taken atomically so the order inside a
+// tile is not deterministic.
+__kernel void bucket_scatter(
+        __global const int *particle_tiles,
+        int count,
+        volatile __global int *tile_cursors,
+        __global int *out_particles
+    ){
+    int id = get_global_id(0);
+    if (id >= count)
+        return;
+
+    int slot = atomic_inc(&tile_cursors[particle_tiles[id]]);
+    out_particles[slot] = id;
+}
+
+// Device resident stepping. Particles live in x, y, vx, vy, m, fx, fy
+// arrays, scheme is 0, 1 or 2 for NGP, CIC or TSC as in mass_assignment.c.
+
+void atomic_add_float(volatile __global float *p, float v){
+    union { unsigned int u; float f; } old, next;
+    do {
+        old.f = *p;
+        next.f = old.f + v;
+    } while (atomic_cmpxchg((volatile __global unsigned int *)p, old.u, next.u) != old.u);
+}
+
+// First node and weights along one axis, u in cells, as MA_stencil_axis.
+int stencil_axis(int scheme, float u, float *w){
+    if (scheme == 0) {
+        w[0] = 1;
+        return (int)u;
+    }
+    if (scheme == 1) {
+        float v = u + 0.5f;
+        int k = (int)v;
+        float d = v - k;
+        w[0] = 1 - d;
+        w[1] = d;
+        return k - 1;
+    }
+    int k = (int)u;
+    float d = u - k - 0.5f;
+    w[0] = 0.5f * (0.5f - d) * (0.5f - d);
+    w[1] = 0.75f - d * d;
+    w[2] = 0.5f * (0.5f + d) * (0.5f + d);
+    return k - 1;
+}
+
+// Adds every particle to the level 0 masses and mass weighted positions,
+// both cleared by the host first.
+__kernel void deposit_particles(
+        __global const float *x,
+        __global const float *y,
+        __global const float *m,
+        int count,
+        int cols,
+        int rows,
+        int scheme,
+        volatile __global float *masses,
+        volatile __global float *moments
+    ){
+    int id = get_global_id(0);
+    if (id >= count)
+        return;
+
+    float px = x[id];
+    float py = y[id];
+    float wx[3], wy[3];
+    int fx = stencil_axis(scheme, clamp(px, 0.0f, 1.0f) * cols, wx);
+    int fy = stencil_axis(scheme, clamp(py, 0.0f, 1.0f) * rows, wy);
+
+    for (int a = 0; a <= scheme; a++) {
+        int row = clamp(fy + a, 0, rows - 1);
+        for (int b = 0; b <= scheme; b++) {
+            int col = clamp(fx + b, 0, cols - 1);
+            float w = m[id] * wy[a] * wx[b];
+            int k = row * cols + col;
+            atomic_add_float(&masses[k], w);
+            atomic_add_float(&moments[2 * k], px * w);
+            atomic_add_float(&moments[2 * k + 1], py * w);
+        }
+    }
+}
+
+// Moves every level 0 tile to the centre of its mass, empty ones to the
+// middle of the tile.
+__kernel void finalize_tiles(
+        __global const float *masses,
+        __global const float2 *moments,
+        int cols,
+        int rows,
+        __global float2 *tiles
+    ){
+    int k = get_global_id(0);
+    if (k >= cols * rows)
+        return;
+
+    if (masses[k] > 0)
+        tiles[k] = moments[k] / masses[k];
+    else
+        tiles[k] = (float2)((k % cols + 0.5f) / cols, (k / cols + 0.5f) / rows);
+}
+
+// Fills level l from level l - 1, as TG_aggregate.
+__kernel void aggregate_level(
+        __global float2 *tiles,
+        __global float *masses,
+        __global int4 *levels,
+        int l
+    ){
+    int4 level = levels[l];
+    int4 below = levels[l - 1];
+    int id = get_global_id(0);
+    if (id >= level.x * level.y)
+        return;
+
+    int r = id / level.x;
+    int c = id % level.x;
+    float mass = 0;
+    float2 weighted = (float2)(0, 0);
+    float2 plain = (float2)(0, 0);
+    int children = 0;
+
+    for (int cr = 2 * r; cr <= 2 * r + 1 && cr < below.y; cr++) {
+        for (int cc = 2 * c; cc <= 2 * c + 1 && cc < below.x; cc++) {
+            int k = below.z + cr * below.x + cc;
+            mass += masses[k];
+            weighted += tiles[k] * masses[k];
+            plain += tiles[k];
+            children++;
+        }
+    }
+
+    int k = level.z + id;
+    masses[k] = mass;
+    tiles[k] = mass > 0 ? weighted / mass : plain / (float)children;
+}
+
+// Reads the level 0 tile forces back into the particles with the deposit
+// stencil.
+__kernel void interpolate_forces(
+        __global const float *x,
+        __global const float *y,
+        int count,
+        int cols,
+        int rows,
+        int scheme,
+        __global const float2 *tile_forces,
+        __global float *fx,
+        __global float *fy
+    ){
+    int id = get_global_id(0);
+    if (id >= count)
+        return;
+
+    float wx[3], wy[3];
+    int sx = stencil_axis(scheme, clamp(x[id], 0.0f, 1.0f) * cols, wx);
+    int sy = stencil_axis(scheme, clamp(y[id], 0.0f, 1.0f) * rows, wy);
+
+    float2 f = (float2)(0, 0);
+    for (int a = 0; a <= scheme; a++) {
+        int row = clamp(sy + a, 0, rows - 1);
+        for (int b = 0; b <= scheme; b++) {
+            int col = clamp(sx + b, 0, cols - 1);
+            f += tile_forces[row * cols + col] * (wy[a] * wx[b]);
+        }
+    }
+    fx[id] = f.x;
+    fy[id] = f.y;
+}
+
+__kernel void kick_particles(
+        __global float *vx,
+        __global float *vy,
+        __global const float *fx,
+        __global const float *fy,
+        __global const float *m,
+        int count,
+        float h
+    ){
+    int id = get_global_id(0);
+    if (id >= count)
+        return;
+
+    vx[id] += fx[id] / m[id] * h;
+    vy[id] += fy[id] / m[id] * h;
+}
+
+__kernel void drift_particles(
+        __global float *x,
+        __global float *y,
+        __global const float *vx,
+        __global const float *vy,
+        int count,
+        float h
+    ){
+    int id = get_global_id(0);
+    if (id >= count)
+        return;
+
+    x[id] = clamp(x[id] + vx[id] * h, 0.0f, 1.0f);
+    y[id] = clamp(y[id] + vy[id] * h, 0.0f, 1.0f);
 }
@@ -0,0 +1,241 @@
+#include <immintrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Tile forces on the CPU. Gives the same results as the kernels in
+// calculate_force_kernel.cl: the flat and symmetric kernels become an
+// all-pairs sum over level 0 run by the direct sum tiles, the hierarchical
+// one gathers the interaction list of every tile and sums it in whole
+// vectors. cp_isa picks the instruction set, DS_ISA_SCALAR gives the plain
+// C version.
+
+#define CP_MAX_LIST 512
+
+float *cp_x;
+float *cp_y;
+float *cp_m;
+float *cp_fx;
+float *cp_fy;
+int cp_capacity;
+ds_isa cp_isa;
+
+const tile_level *cp_levels;
+int cp_level_count;
+int cp_tile_count;
+int cp_fine_count;
+
+void CP_init(const tile_level *levels, int level_count, ds_isa isa){
+    cp_levels = levels;
+    cp_level_count = level_count;
+    cp_tile_count = levels[level_count - 1].offset
+        + levels[level_count - 1].cols * levels[level_count - 1].rows;
+    cp_fine_count = levels[0].cols * levels[0].rows;
+    cp_isa = isa;
+    cp_capacity = PS_padded(cp_tile_count);
+    cp_x = PS_alloc(cp_capacity);
+    cp_y = PS_alloc(cp_capacity);
+    cp_m = PS_alloc(cp_capacity);
+    cp_fx = PS_alloc(cp_capacity);
+    cp_fy = PS_alloc(cp_capacity);
+}
+
+vectorf CP_sum_scalar(float px, float py, const float *x, const float *y, const float *m,
+        int count){
+    vectorf total = {0, 0};
+    for (int j = 0; j < count; j++) {
+        float dx = x[j] - px;
+        float dy = y[j] - py;
+        float dist2 = dx * dx + dy * dy;
+        if (dist2 < FORCE_MIN_DIST * FORCE_MIN_DIST)
+            continue;
+        float inv = 1.0f / sqrtf(dist2);
+        float s = FORCE_K * m[j] * inv * inv * inv;
+        total.x += s * dx;
+        total.y += s * dy;
+    }
+    return total;
+}
+
+// count is a multiple of 8, the padding has no mass
+__attribute__((target("avx2,fma")))
+vectorf CP_sum_avx2(float px, float py, const float *x, const float *y, const float *m,
+        int count){
+    const __m256 min2 = _mm256_set1_ps(FORCE_MIN_DIST * FORCE_MIN_DIST);
+    const __m256 k = _mm256_set1_ps(FORCE_K);
+    __m256 xi = _mm256_set1_ps(px);
+    __m256 yi = _mm256_set1_ps(py);
+    __m256 fx = _mm256_setzero_ps();
+    __m256 fy = _mm256_setzero_ps();
+
+    for (int j = 0; j < count; j += 8) {
+        __m256 dx = _mm256_sub_ps(_mm256_load_ps(&x[j]), xi);
+        __m256 dy = _mm256_sub_ps(_mm256_load_ps(&y[j]), yi);
+        __m256 dist2 = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+        __m256 inv = _mm256_div_ps(_mm256_set1_ps(1), _mm256_sqrt_ps(dist2));
+        __m256 s = _mm256_mul_ps(_mm256_mul_ps(k, _mm256_load_ps(&m[j])),
+                _mm256_mul_ps(inv, _mm256_mul_ps(inv, inv)));
+        s = _mm256_and_ps(s, _mm256_cmp_ps(dist2, min2, _CMP_GE_OQ));
+        fx = _mm256_fmadd_ps(s, dx, fx);
+        fy = _mm256_fmadd_ps(s, dy, fy);
+    }
+
+    float lanes_x[8], lanes_y[8];
+    _mm256_storeu_ps(lanes_x, fx);
+    _mm256_storeu_ps(lanes_y, fy);
+    vectorf total = {0, 0};
+    for (int l = 0; l < 8; l++) {
+        total.x += lanes_x[l];
+        total.y += lanes_y[l];
+    }
+    return total;
+}
+
+// count is a multiple of 16, the padding has no mass
+__attribute__((target("avx512f")))
+vectorf CP_sum_avx512(float px, float py, const float *x, const float *y, const float *m,
+        int count){
+    const __m512 min2 = _mm512_set1_ps(FORCE_MIN_DIST * FORCE_MIN_DIST);
+    const __m512 k = _mm512_set1_ps(FORCE_K);
+    __m512 xi = _mm512_set1_ps(px);
+    __m512 yi = _mm512_set1_ps(py);
+    __m512 fx = _mm512_setzero_ps();
+    __m512 fy = _mm512_setzero_ps();
+
+    for (int j = 0; j < count; j += 16) {
+        __m512 dx = _mm512_sub_ps(_mm512_load_ps(&x[j]), xi);
+        __m512 dy = _mm512_sub_ps(_mm512_load_ps(&y[j]), yi);
+        __m512 dist2 = _mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy));
+        __m512 inv = _mm512_div_ps(_mm512_set1_ps(1), _mm512_sqrt_ps(dist2));
+        __mmask16 valid = _mm512_cmp_ps_mask(dist2, min2, _CMP_GE_OQ);
+        __m512 s = _mm512_maskz_mul_ps(valid, _mm512_mul_ps(k, _mm512_load_ps(&m[j])),
+                _mm512_mul_ps(inv, _mm512_mul_ps(inv, inv)));
+        fx = _mm512_fmadd_ps(s, dx, fx);
+        fy = _mm512_fmadd_ps(s, dy, fy);
+    }
+
+    vectorf total = {_mm512_reduce_add_ps(fx), _mm512_reduce_add_ps(fy)};
+    return total;
+}
+
+vectorf CP_sum(float px, float py, const float *x, const float *y, const float *m, int count){
+    switch (cp_isa) {
+        case DS_ISA_AVX512:
+            return CP_sum_avx512(px, py, x, y, m, count);
+        case DS_ISA_AVX2:
+            return CP_sum_avx2(px, py, x, y, m, count);
+        default:
+            return CP_sum_scalar(px, py, x, y, m, count);
+    }
+}
+
+// Same walk as calculate_force_hierarchical, except the sources are first
+// copied into a padded list so the sum runs whole vectors. The list is
+// flushed whenever it could overflow.
+void CP_hierarchical_range(int begin, int end, int thread, void *ctx){
+    const tile_level *fine = &cp_levels[0];
+    _Alignas(PS_ALIGN) float lx[CP_MAX_LIST + PS_PAD];
+    _Alignas(PS_ALIGN) float ly[CP_MAX_LIST + PS_PAD];
+    _Alignas(PS_ALIGN) float lm[CP_MAX_LIST + PS_PAD];
+
+    for (int id = begin; id < end; id++) {
+        int row = id / fine->cols;
+        int col = id % fine->cols;
+        float px = cp_x[id];
+        float py = cp_y[id];
+        vectorf force = {0, 0};
+        int n = 0;
+
+        for (int l = cp_level_count - 1; l >= 0; l--) {
+            const tile_level *level = &cp_levels[l];
+            int r = row >> l;
+            int c = col >> l;
+            int r0 = 0, r1 = level->rows - 1, c0 = 0, c1 = level->cols - 1;
+
+            if (l < cp_level_count - 1) {
+                int pr = r >> 1;
+                int pc = c >> 1;
+                r0 = 2 * (pr - 1) > 0 ? 2 * (pr - 1) : 0;
+                r1 = 2 * (pr + 1) + 1 < level->rows - 1 ? 2 * (pr + 1) + 1 : level->rows - 1;
+                c0 = 2 * (pc - 1) > 0 ? 2 * (pc - 1) : 0;
+                c1 = 2 * (pc + 1) + 1 < level->cols - 1 ? 2 * (pc + 1) + 1 : level->cols - 1;
+            }
+
+            for (int rr = r0; rr <= r1; rr++) {
+                for (int cc = c0; cc <= c1; cc++) {
+                    if (l > 0 && abs(rr - r) <= 1 && abs(cc - c) <= 1)
+                        continue;
+                    int k = level->offset + rr * level->cols + cc;
+                    lx[n] = cp_x[k];
+                    ly[n] = cp_y[k];
+                    lm[n] = cp_m[k];
+                    if (++n == CP_MAX_LIST) {
+                        vectorf f = CP_sum(px, py, lx, ly, lm, n);
+                        vector_add(&force, &f);
+                        n = 0;
+                    }
+                }
+            }
+        }
+
+        int padded = PS_padded(n);
+        for (int j = n; j < padded; j++) {
+            lx[j] = 0;
+            ly[j] = 0;
+            lm[j] = 0;
+        }
+        vectorf f = CP_sum(px, py, lx, ly, lm, padded);
+        vector_add(&force, &f);
+        cp_fx[id] = force.x;
+        cp_fy[id] = force.y;
+    }
+}
+
+// positions and masses hold every level of the tile hierarchy
+void CP_upload(const vectorf *positions, const float *masses){
+    for (int k = 0; k < cp_tile_count; k++) {
+        cp_x[k] = positions[k].x;
+        cp_y[k] = positions[k].y;
+        cp_m[k] = masses[k];
+    }
+}
+
+void CP_step(px_kernel kernel){
+    if (kernel == PX_KERNEL_HIERARCHICAL) {
+        parallel_for(cp_fine_count, CP_hierarchical_range, NULL);
+        return;
+    }
+
+    // all pairs over level 0 only, the coarse levels must not pull as well
+    for (int k = cp_fine_count; k < cp_capacity; k++) {
+        cp_m[k] = 0;
+    }
+    ds_x = cp_x;
+    ds_y = cp_y;
+    ds_m = cp_m;
+    ds_fx = cp_fx;
+    ds_fy = cp_fy;
+    ds_padded = PS_padded(cp_fine_count);
+    parallel_for(ds_padded / PS_PAD, DS_run_tiles, &cp_isa);
+}
+
+// forces of level 0
+void CP_download(vectorf *output){
+    for (int k = 0; k < cp_fine_count; k++) {
+        output[k].x = cp_fx[k];
+        output[k].y = cp_fy[k];
+    }
+}
+
+void CP_clear(){
+    free(cp_x);
+    free(cp_y);
+    free(cp_m);
+    free(cp_fx);
+    free(cp_fy);
+    cp_x = NULL;
+    cp_y = NULL;
+    cp_m = NULL;
+    cp_fx = NULL;
+    cp_fy = NULL;
+    cp_capacity = 0;
+}
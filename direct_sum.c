@@ -0,0 +1,199 @@
+#include <immintrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Exact all-pairs sum of calculate_force_cpu, the reference the approximate
+// engines are checked against. Works in place on the particle store, whose
+// padding has zero mass so it never contributes. Targets are processed in
+// register tiles while every source is broadcast against them, the targets
+// are spread over all cores in units of PS_PAD.
+
+const float *ds_x;
+const float *ds_y;
+const float *ds_m;
+float *ds_fx;
+float *ds_fy;
+int ds_padded;
+
+enum ds_isa_e {
+    DS_ISA_SCALAR,
+    DS_ISA_AVX2,
+    DS_ISA_AVX512,
+};
+
+typedef enum ds_isa_e ds_isa;
+
+ds_isa ds_selected_isa;
+
+const char *DS_isa_name(ds_isa isa){
+    switch (isa) {
+        case DS_ISA_AVX512:
+            return "avx512";
+        case DS_ISA_AVX2:
+            return "avx2";
+        default:
+            return "scalar";
+    }
+}
+
+void DS_init(){
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        ds_selected_isa = DS_ISA_AVX512;
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        ds_selected_isa = DS_ISA_AVX2;
+    } else {
+        ds_selected_isa = DS_ISA_SCALAR;
+    }
+    printf("Direct sum kernel: %s\n", DS_isa_name(ds_selected_isa));
+}
+
+void DS_tile_scalar(int begin, int end){
+    for (int i = begin; i < end; i++) {
+        float fx = 0;
+        float fy = 0;
+        for (int j = 0; j < ds_padded; j++) {
+            float dx = ds_x[j] - ds_x[i];
+            float dy = ds_y[j] - ds_y[i];
+            float dist2 = dx * dx + dy * dy;
+            if (dist2 < FORCE_MIN_DIST * FORCE_MIN_DIST)
+                continue;
+            float inv = 1.0f / sqrtf(dist2);
+            float s = FORCE_K * ds_m[j] * inv * inv * inv;
+            fx += s * dx;
+            fy += s * dy;
+        }
+        ds_fx[i] = fx;
+        ds_fy[i] = fy;
+    }
+}
+
+// vectors x 8 targets held in registers, rsqrt refined with one Newton step
+__attribute__((target("avx2,fma"), always_inline))
+static inline void DS_block_avx2(int i, const int vectors){
+    const __m256 min2 = _mm256_set1_ps(FORCE_MIN_DIST * FORCE_MIN_DIST);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three_halves = _mm256_set1_ps(1.5f);
+    __m256 xi[4], yi[4], fx[4], fy[4];
+
+    for (int t = 0; t < vectors; t++) {
+        xi[t] = _mm256_load_ps(&ds_x[i + 8 * t]);
+        yi[t] = _mm256_load_ps(&ds_y[i + 8 * t]);
+        fx[t] = _mm256_setzero_ps();
+        fy[t] = _mm256_setzero_ps();
+    }
+
+    for (int j = 0; j < ds_padded; j++) {
+        __m256 xj = _mm256_broadcast_ss(&ds_x[j]);
+        __m256 yj = _mm256_broadcast_ss(&ds_y[j]);
+        __m256 mj = _mm256_set1_ps(FORCE_K * ds_m[j]);
+        for (int t = 0; t < vectors; t++) {
+            __m256 dx = _mm256_sub_ps(xj, xi[t]);
+            __m256 dy = _mm256_sub_ps(yj, yi[t]);
+            __m256 dist2 = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+            __m256 inv = _mm256_rsqrt_ps(dist2);
+            __m256 hd = _mm256_mul_ps(_mm256_mul_ps(half, dist2), _mm256_mul_ps(inv, inv));
+            inv = _mm256_mul_ps(inv, _mm256_sub_ps(three_halves, hd));
+            __m256 s = _mm256_mul_ps(mj, _mm256_mul_ps(inv, _mm256_mul_ps(inv, inv)));
+            s = _mm256_and_ps(s, _mm256_cmp_ps(dist2, min2, _CMP_GE_OQ));
+            fx[t] = _mm256_fmadd_ps(s, dx, fx[t]);
+            fy[t] = _mm256_fmadd_ps(s, dy, fy[t]);
+        }
+    }
+
+    for (int t = 0; t < vectors; t++) {
+        _mm256_store_ps(&ds_fx[i + 8 * t], fx[t]);
+        _mm256_store_ps(&ds_fy[i + 8 * t], fy[t]);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void DS_tile_avx2(int begin, int end){
+    int i = begin;
+    for (; i + 32 <= end; i += 32) {
+        DS_block_avx2(i, 4);
+    }
+    for (; i < end; i += 16) {
+        DS_block_avx2(i, 2);
+    }
+}
+
+// vectors x 16 targets held in registers, rsqrt14 refined with one Newton step
+__attribute__((target("avx512f"), always_inline))
+static inline void DS_block_avx512(int i, const int vectors){
+    const __m512 min2 = _mm512_set1_ps(FORCE_MIN_DIST * FORCE_MIN_DIST);
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 three_halves = _mm512_set1_ps(1.5f);
+    __m512 xi[4], yi[4], fx[4], fy[4];
+
+    for (int t = 0; t < vectors; t++) {
+        xi[t] = _mm512_load_ps(&ds_x[i + 16 * t]);
+        yi[t] = _mm512_load_ps(&ds_y[i + 16 * t]);
+        fx[t] = _mm512_setzero_ps();
+        fy[t] = _mm512_setzero_ps();
+    }
+
+    for (int j = 0; j < ds_padded; j++) {
+        __m512 xj = _mm512_set1_ps(ds_x[j]);
+        __m512 yj = _mm512_set1_ps(ds_y[j]);
+        __m512 mj = _mm512_set1_ps(FORCE_K * ds_m[j]);
+        for (int t = 0; t < vectors; t++) {
+            __m512 dx = _mm512_sub_ps(xj, xi[t]);
+            __m512 dy = _mm512_sub_ps(yj, yi[t]);
+            __m512 dist2 = _mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy));
+            __m512 inv = _mm512_rsqrt14_ps(dist2);
+            __m512 hd = _mm512_mul_ps(_mm512_mul_ps(half, dist2), _mm512_mul_ps(inv, inv));
+            inv = _mm512_mul_ps(inv, _mm512_sub_ps(three_halves, hd));
+            __mmask16 valid = _mm512_cmp_ps_mask(dist2, min2, _CMP_GE_OQ);
+            __m512 s = _mm512_maskz_mul_ps(valid, mj,
+                    _mm512_mul_ps(inv, _mm512_mul_ps(inv, inv)));
+            fx[t] = _mm512_fmadd_ps(s, dx, fx[t]);
+            fy[t] = _mm512_fmadd_ps(s, dy, fy[t]);
+        }
+    }
+
+    for (int t = 0; t < vectors; t++) {
+        _mm512_store_ps(&ds_fx[i + 16 * t], fx[t]);
+        _mm512_store_ps(&ds_fy[i + 16 * t], fy[t]);
+    }
+}
+
+__attribute__((target("avx512f")))
+void DS_tile_avx512(int begin, int end){
+    int i = begin;
+    for (; i + 64 <= end; i += 64) {
+        DS_block_avx512(i, 4);
+    }
+    for (; i < end; i += 16) {
+        DS_block_avx512(i, 1);
+    }
+}
+
+// ctx points to the ds_isa to run
+void DS_run_tiles(int begin, int end, int thread, void *ctx){
+    begin *= PS_PAD;
+    end *= PS_PAD;
+    switch (*(ds_isa*)ctx) {
+        case DS_ISA_AVX512:
+            DS_tile_avx512(begin, end);
+            break;
+        case DS_ISA_AVX2:
+            DS_tile_avx2(begin, end);
+            break;
+        default:
+            DS_tile_scalar(begin, end);
+            break;
+    }
+}
+
+void DS_calculate_forces(particle_store *s){
+    ds_x = s->x;
+    ds_y = s->y;
+    ds_m = s->m;
+    ds_fx = s->fx;
+    ds_fy = s->fy;
+    ds_padded = s->capacity;
+
+    parallel_for(ds_padded / PS_PAD, DS_run_tiles, &ds_selected_isa);
+}
@@ -0,0 +1,25 @@
+// CPU copy of calculate_force_gpu from calculate_force_kernel.cl, keep both in sync.
+
+#define FORCE_K 10.0f
+#define FORCE_MIN_DIST 0.0000001f
+
+// Force that a body of the given mass at p1 exerts on a particle at p2.
+// The result is divided by pmass when it is turned into an acceleration.
+vectorf calculate_force_cpu(const vectorf *p1, const vectorf *p2, float mass){
+    vectorf force_vector;
+    float dx = p1->x - p2->x;
+    float dy = p1->y - p2->y;
+    float dist = sqrtf(dx * dx + dy * dy);
+
+    if (dist < FORCE_MIN_DIST){
+        force_vector.x = 0;
+        force_vector.y = 0;
+        return force_vector;
+    }
+    float force = FORCE_K * mass / (dist * dist);
+
+    force_vector.x = force * dx / dist;
+    force_vector.y = force * dy / dist;
+
+    return force_vector;
+}
@@ -1,3 +1,5 @@
+// pthread_setaffinity_np and the CPU_* macros used by parallel.c
+#define _GNU_SOURCE
 
 #include <CL/cl_platform.h>
 #include <limits.h>
@@ -11,67 +13,84 @@
 #include <SDL2/SDL_render.h>
 
 #include "opencl_physics.c"
+#include "parallel.c"
+#include "vector.c"
+#include "particle_store.c"
+#include "morton_sort.c"
+#include "force_law.c"
+#include "mass_assignment.c"
+#include "barnes_hut.c"
+#include "particle_mesh.c"
+#include "p3m.c"
+#include "direct_sum.c"
+#include "tile_grid.c"
+#include "cpu_physics.c"
+#include "physics_backend.c"
 
 
 #define SCREEN_WIDTH 800
 #define SCREEN_HEIGHT 600
 
-#define TILES_V 5
-#define TILES_H 5
+#define MAX_STEPS_PER_FRAME 64
 
-struct vector_f_s {
-    float x;
-    float y;
+enum force_engine_e {
+    ENGINE_TILES,
+    ENGINE_BARNES_HUT,
+    ENGINE_PARTICLE_MESH,
+    ENGINE_P3M,
+    ENGINE_DIRECT,
 };
 
-typedef struct vector_f_s vectorf;
+typedef enum force_engine_e force_engine;
 
-struct vector_i_s {
-    int x;
-    int y;
+enum integrator_e {
+    INTEGRATOR_EULER,
+    INTEGRATOR_LEAPFROG,
 };
 
-typedef struct vector_i_s vectori;
-
-float mapf(float x, float in_min, float in_max, float out_min, float out_max) {
-    return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
-}
-
-void vector_add(vectorf *v1, const vectorf *v2) {
-    v1->x += v2->x;
-    v1->y += v2->y;
-}
-void vector_multiply_f(vectorf *v, float f) {
-    v->x *= f;
-    v->y *= f;
-}
-void vector_divide_f(vectorf *v, float f) {
-    v->x /= f;
-    v->y /= f;
-}
-float distancePow2(const vectorf *p1, const vectorf *p2) {
-    return pow(p1->x - p2->x, 2) + pow(p1->y - p2->y, 2);
-}
-float distance(const vectorf *p1, const vectorf *p2) {
-    return sqrt(distancePow2(p1, p2));
-}
+typedef enum integrator_e integrator_kind;
 
 float G = 6.67e-11f;
 float pmass = 100;
 
 bool draw_grid = false;
-float tile_size_H = 1.0 / TILES_H;
-float tile_size_V = 1.0 / TILES_V;
+int tiles_h = 5;
+int tiles_v = 5;
+px_kernel tile_kernel = PX_KERNEL_HIERARCHICAL;
+mass_assignment assignment = ASSIGN_NGP;
+bool bucket_index = false;     // nothing in the tree reads the index yet, -bucket asks for it
+bool bucket_on_gpu = false;
+physics_backend_kind tile_backend = PB_AUTO;
+// particles stay on the OpenCL device and are only read back to be drawn
+bool device_resident = false;
+// worker pool size, 0 uses every core
+int thread_count = 0;
+bool pin_threads = false;
+float tile_size_H;
+float tile_size_V;
 
 int particle_amount = 10;
-float mult = 0.00001;
-
-vectorf *particles;
-vectorf *accelerations;
-float tile_masses[TILES_V * TILES_H];
-
-vectorf tiles[TILES_V * TILES_H];
-vectorf tile_forces[TILES_V * TILES_H];
+// sqrt of the old 0.00001 position factor, so euler runs trace the same paths
+float dt = 0.0031623;
+integrator_kind integrator = INTEGRATOR_LEAPFROG;
+bool forces_valid = false;
+// steps between Morton reorderings of the particle store, 0 disables them
+int sort_interval = 16;
+int steps_since_sort = 0;
+
+float step_rate = 60;
+int render_every = 0;
+double step_accumulator = 0;
+Uint64 last_counter;
+Uint64 report_counter;
+long steps_done = 0;
+long frames_done = 0;
+
+force_engine engine = ENGINE_TILES;
+float bh_theta = 0.5;
+int mesh_size = 256;
+
+particle_store particles;
 
 float screen_max_fw;
 float screen_max_fh;
@@ -80,23 +99,6 @@ SDL_Renderer *renderer;
 SDL_Surface *wsurface;
 
 
-vectori findTile(vectorf *particle){
-    vectori coordinates;
-    coordinates.x = fmin(fmax((int)(particle->x / tile_size_H), 0), TILES_H - 1);
-    coordinates.y = fmin(fmax((int)(particle->y / tile_size_V), 0), TILES_V - 1);
-    return coordinates;
-}
-
-vectorf *getTile(int row, int col){
-    return &tiles[row * TILES_H + col];
-}
-float *getMass(int row, int col){
-    return &tile_masses[row * TILES_H + col];
-}
-vectorf *getTileForce(int row, int col){
-    return &tile_forces[row * TILES_H + col];
-}
-
 void start() {
     if (SCREEN_WIDTH > SCREEN_HEIGHT) {
         screen_max_fw = 1;
@@ -106,18 +108,153 @@ void start() {
         screen_max_fh = 1;
     }
 
-    for (int i = 0; i < TILES_V; i++) {
-        for (int j = 0; j < TILES_H; j++) {
-            getTile(i, j)->x = tile_size_H * j;
-            getTile(i, j)->y = tile_size_H * i;
-        }
+    for (int i = 0; i < particles.count; i++) {
+        particles.x[i] = (float)rand() / (float)RAND_MAX;
+        particles.y[i] = (float)rand() / (float)RAND_MAX;
+    }
+}
+
+
+int parse_int(const char *flag, const char *value, int *out) {
+    char *endptr;
+    long num = strtol(value, &endptr, 10);
+    if (*endptr != '\0') {
+        fprintf(stderr, "Invalid number for %s: %s\n", flag, value);
+        return 1;
+    }
+
+    if (num < INT_MIN || num > INT_MAX) {
+        fprintf(stderr, "Invalid int for %s: %s\n", flag, value);
+        return 1;
+    }
+
+    *out = (int) num;
+    return 0;
+}
+
+int parse_float(const char *flag, const char *value, float *out) {
+    char *endptr;
+    float num = strtof(value, &endptr);
+    if (*endptr != '\0') {
+        fprintf(stderr, "Invalid number for %s: %s\n", flag, value);
+        return 1;
+    }
+
+    *out = num;
+    return 0;
+}
+
+// "N" for an N x N grid or "COLSxROWS"
+int parse_grid(const char *flag, const char *value, int *cols, int *rows) {
+    char *endptr;
+    long c = strtol(value, &endptr, 10);
+    long r = c;
+    if (*endptr == 'x') {
+        r = strtol(endptr + 1, &endptr, 10);
+    }
+    // cells are counted in int everywhere
+    if (*endptr != '\0' || c < 1 || r < 1 || c > 65536 || r > 65536 || c * r > INT_MAX) {
+        fprintf(stderr, "Invalid grid for %s: %s\n", flag, value);
+        return 1;
+    }
+
+    *cols = (int) c;
+    *rows = (int) r;
+    return 0;
+}
+
+int parse_tile_kernel(const char *value, px_kernel *out) {
+    if (strcmp(value, "hier") == 0) {
+        *out = PX_KERNEL_HIERARCHICAL;
+    } else if (strcmp(value, "flat") == 0) {
+        *out = PX_KERNEL_FLAT;
+    } else if (strcmp(value, "sym") == 0) {
+        *out = PX_KERNEL_SYMMETRIC;
+    } else {
+        fprintf(stderr, "Unknown tile kernel: %s (expected hier, flat or sym)\n", value);
+        return 1;
+    }
+    return 0;
+}
+
+int parse_assignment(const char *value, mass_assignment *out) {
+    if (strcmp(value, "ngp") == 0) {
+        *out = ASSIGN_NGP;
+    } else if (strcmp(value, "cic") == 0) {
+        *out = ASSIGN_CIC;
+    } else if (strcmp(value, "tsc") == 0) {
+        *out = ASSIGN_TSC;
+    } else {
+        fprintf(stderr, "Unknown assignment: %s (expected ngp, cic or tsc)\n", value);
+        return 1;
+    }
+    return 0;
+}
+
+int parse_integrator(const char *value, integrator_kind *out) {
+    if (strcmp(value, "euler") == 0) {
+        *out = INTEGRATOR_EULER;
+    } else if (strcmp(value, "leapfrog") == 0) {
+        *out = INTEGRATOR_LEAPFROG;
+    } else {
+        fprintf(stderr, "Unknown integrator: %s (expected euler or leapfrog)\n", value);
+        return 1;
     }
-    for (int i = 0; i < particle_amount; i++) {
-        particles[i].x = (float)rand() / (float)RAND_MAX;
-        particles[i].y = (float)rand() / (float)RAND_MAX;
+    return 0;
+}
+
+int parse_bucket_device(const char *value, bool *out_index, bool *out_gpu) {
+    if (strcmp(value, "off") == 0) {
+        *out_index = false;
+        *out_gpu = false;
+    } else if (strcmp(value, "cpu") == 0) {
+        *out_index = true;
+        *out_gpu = false;
+    } else if (strcmp(value, "gpu") == 0) {
+        *out_index = true;
+        *out_gpu = true;
+    } else {
+        fprintf(stderr, "Unknown bucketing device: %s (expected off, cpu or gpu)\n", value);
+        return 1;
+    }
+    return 0;
+}
+
+bool opencl_active() {
+    return pb_active != NULL && pb_active_kind == PB_OPENCL;
+}
+
+int parse_zero_copy(const char *value, px_zero_copy_mode *out) {
+    if (strcmp(value, "auto") == 0) {
+        *out = PX_ZERO_COPY_AUTO;
+    } else if (strcmp(value, "on") == 0) {
+        *out = PX_ZERO_COPY_ON;
+    } else if (strcmp(value, "off") == 0) {
+        *out = PX_ZERO_COPY_OFF;
+    } else {
+        fprintf(stderr, "Unknown zero-copy mode: %s (expected auto, on or off)\n", value);
+        return 1;
     }
+    return 0;
 }
 
+int parse_engine(const char *value, force_engine *out) {
+    if (strcmp(value, "tiles") == 0) {
+        *out = ENGINE_TILES;
+    } else if (strcmp(value, "bh") == 0) {
+        *out = ENGINE_BARNES_HUT;
+    } else if (strcmp(value, "pm") == 0) {
+        *out = ENGINE_PARTICLE_MESH;
+    } else if (strcmp(value, "p3m") == 0) {
+        *out = ENGINE_P3M;
+    } else if (strcmp(value, "direct") == 0) {
+        *out = ENGINE_DIRECT;
+    } else {
+        fprintf(stderr, "Unknown engine: %s (expected tiles, bh, pm, p3m or direct)\n", value);
+        return 1;
+    }
+    return 0;
+}
 
 int parse_args(int argc, char **argv) {
     printf("arguments c: %d\n", argc);
@@ -126,26 +263,120 @@ int parse_args(int argc, char **argv) {
         return 0;
 
     for (int i = 1; i < argc; i++) {
+        bool takes_value = strcmp(argv[i], "-p") == 0
+            || strcmp(argv[i], "-e") == 0
+            || strcmp(argv[i], "-theta") == 0
+            || strcmp(argv[i], "-m") == 0
+            || strcmp(argv[i], "-t") == 0
+            || strcmp(argv[i], "-k") == 0
+            || strcmp(argv[i], "-a") == 0
+            || strcmp(argv[i], "-i") == 0
+            || strcmp(argv[i], "-dt") == 0
+            || strcmp(argv[i], "-rate") == 0
+            || strcmp(argv[i], "-max") == 0
+            || strcmp(argv[i], "-sort") == 0
+            || strcmp(argv[i], "-bucket") == 0
+            || strcmp(argv[i], "-j") == 0
+            || strcmp(argv[i], "-backend") == 0
+            || strcmp(argv[i], "-zerocopy") == 0;
+
+        if (takes_value && i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[i]);
+            return 1;
+        }
+
         if (strcmp(argv[i], "-p") == 0) {
-            if (i + 1 >= argc) {
-                fprintf(stderr, "Missing value for -p\n");
+            if (parse_int(argv[i], argv[i + 1], &particle_amount) != 0)
+                return 1;
+            i++;
+        } else if (strcmp(argv[i], "-e") == 0) {
+            if (parse_engine(argv[i + 1], &engine) != 0)
+                return 1;
+            i++;
+        } else if (strcmp(argv[i], "-theta") == 0) {
+            if (parse_float(argv[i], argv[i + 1], &bh_theta) != 0)
+                return 1;
+            i++;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            if (parse_int(argv[i], argv[i + 1], &mesh_size) != 0)
+                return 1;
+            i++;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            if (parse_grid(argv[i], argv[i + 1], &tiles_h, &tiles_v) != 0)
+                return 1;
+            i++;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            if (parse_tile_kernel(argv[i + 1], &tile_kernel) != 0)
+                return 1;
+            i++;
+        } else if (strcmp(argv[i], "-a") == 0) {
+            if (parse_assignment(argv[i + 1], &assignment) != 0)
+                return 1;
+            i++;
+        } else if (strcmp(argv[i], "-i") == 0) {
+            if (parse_integrator(argv[i + 1], &integrator) != 0)
+                return 1;
+            i++;
+        } else if (strcmp(argv[i], "-dt") == 0) {
+            if (parse_float(argv[i], argv[i + 1], &dt) != 0)
+                return 1;
+            i++;
+        } else if (strcmp(argv[i], "-rate") == 0) {
+            if (parse_float(argv[i], argv[i + 1], &step_rate) != 0)
+                return 1;
+            if (step_rate <= 0) {
+                fprintf(stderr, "Invalid step rate: %s\n", argv[i + 1]);
                 return 1;
             }
-
-            char *endptr;
-            long num = strtol(argv[i + 1], &endptr, 10);
-            if (*endptr != '\0') {
-                fprintf(stderr, "Invalid number: %s\n", argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "-max") == 0) {
+            if (parse_int(argv[i], argv[i + 1], &render_every) != 0)
+                return 1;
+            if (render_every < 1) {
+                fprintf(stderr, "Invalid render interval: %s\n", argv[i + 1]);
                 return 1;
             }
-
-            if (num < INT_MIN || num > INT_MAX) {
-                fprintf(stderr, "Invalid int: %s\n", argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "-sort") == 0) {
+            if (parse_int(argv[i], argv[i + 1], &sort_interval) != 0)
+                return 1;
+            if (sort_interval < 0) {
+                fprintf(stderr, "Invalid sort interval: %s\n", argv[i + 1]);
                 return 1;
             }
-
-            particle_amount = (int) num;
             i++;
+        } else if (strcmp(argv[i], "-bucket") == 0) {
+            if (parse_bucket_device(argv[i + 1], &bucket_index, &bucket_on_gpu) != 0)
+                return 1;
+            i++;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            if (parse_int(argv[i], argv[i + 1], &thread_count) != 0)
+                return 1;
+            if (thread_count < 0) {
+                fprintf(stderr, "Invalid thread count: %s\n", argv[i + 1]);
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "-backend") == 0) {
+            if (PB_parse(argv[i + 1], &tile_backend) != 0)
+                return 1;
+            i++;
+        } else if (strcmp(argv[i], "-zerocopy") == 0) {
+            if (parse_zero_copy(argv[i + 1], &px_zero_copy_request) != 0)
+                return 1;
+            i++;
+        } else if (strcmp(argv[i], "-device") == 0) {
+            device_resident = true;
+        } else if (strcmp(argv[i], "-fastmath") == 0) {
+            px_fast_math = true;
+        } else if (strcmp(argv[i], "-multidevice") == 0) {
+            px_multi_device = true;
+        } else if (strcmp(argv[i], "-profile") == 0) {
+            px_profiling = true;
+        } else if (strcmp(argv[i], "-tune") == 0) {
+            px_retune = true;
+        } else if (strcmp(argv[i], "-pin") == 0) {
+            pin_threads = true;
         } else if (strcmp(argv[i], "-g") == 0) {
             draw_grid = true;
         } else {
@@ -158,55 +389,127 @@ int parse_args(int argc, char **argv) {
 }
 
 
-void loop() {
-    vectorf forces[particle_amount];
+// Rebuilds the tile to particle index, see TG_bucket.
+void bucket_tiles() {
+    if (bucket_on_gpu) {
+        TG_reserve_buckets(particles.count);
+        PX_bucket_particles(particles.x, particles.y, particles.count, tiles_h, tiles_v,
+                tg_bucket_start, tg_bucket_particles);
+    } else {
+        TG_bucket(&particles);
+    }
+}
 
-    for (int i = 0; i < TILES_V; i++) {
-        for (int j = 0; j < TILES_H; j++) {
-            *getMass(i,j) = 0;
-        }
+// The bucketing does not depend on the forces. On the CPU it runs while an
+// OpenCL backend is busy with the tile kernel, on the GPU it is queued
+// behind that kernel and does not overlap with it.
+void calculate_tile_forces() {
+    TG_bin(&particles, assignment);
+    TG_aggregate();
+    pb_active->upload(tiles, tile_masses);
+    pb_active->step(tile_kernel);
+    if (bucket_index)
+        bucket_tiles();
+    pb_active->download(tile_forces);
+    MA_interpolate(assignment, &particles, tile_forces, tiles_h, tiles_v);
+}
+
+void compute_forces() {
+    if (device_resident) {
+        PX_device_forces(tile_kernel);
+        return;
     }
-    for (int i = 0; i < particle_amount; i++) {
-        vectorf *p = &particles[i];
-        vectori tile = findTile(p); 
-        *getMass(tile.y, tile.x) += pmass;
+
+    switch (engine) {
+        case ENGINE_TILES:
+            calculate_tile_forces();
+            break;
+        case ENGINE_BARNES_HUT:
+            BH_calculate_forces(&particles, bh_theta);
+            break;
+        case ENGINE_PARTICLE_MESH:
+            PM_calculate_forces(&particles, assignment);
+            break;
+        case ENGINE_P3M:
+            P3M_calculate_forces(&particles, assignment);
+            break;
+        case ENGINE_DIRECT:
+            DS_calculate_forces(&particles);
+            break;
     }
-    //calculate_tile_forces();
-    printf("here1\n");
-    PX_calculate_physics((cl_float2*)tiles, tile_masses, (cl_float*)tile_forces, TILES_H, TILES_V);    
-    printf("here2\n");
-    for (int i = 0; i < particle_amount; i++) {
-        vectorf *particle = &particles[i];
-        vectori tile = findTile(particle);
-        accelerations[i].x += getTileForce(tile.y, tile.x)->x / pmass;
-        accelerations[i].y += getTileForce(tile.y, tile.x)->y / pmass;
-
-        vectorf *acceleration = &accelerations[i];
-
-        particle->x = particle->x + acceleration->x * mult;
-        particle->y = particle->y + acceleration->y * mult;
-        if(particle->x > 1){
-            particle->x = 1;
-        }
-        if(particle->x < 0){
-            particle->x = 0;
-        }
-        if(particle->y > 1){
-            particle->y = 1;
-        }
-        if(particle->y < 0){
-            particle->y = 0;
-        }
-        SDL_RenderDrawPoint(renderer, (int)(particles[i].x * SCREEN_WIDTH),
-                (int)(particles[i].y * SCREEN_HEIGHT));
+}
+
+void kick_range(int begin, int end, int thread, void *ctx) {
+    float h = *(float*)ctx;
+    const float *m = particles.m;
+    for (int i = begin; i < end; i++) {
+        particles.vx[i] += particles.fx[i] / m[i] * h;
+        particles.vy[i] += particles.fy[i] / m[i] * h;
+    }
+}
+
+void drift_range(int begin, int end, int thread, void *ctx) {
+    float h = *(float*)ctx;
+    for (int i = begin; i < end; i++) {
+        particles.x[i] = fminf(fmaxf(particles.x[i] + particles.vx[i] * h, 0), 1);
+        particles.y[i] = fminf(fmaxf(particles.y[i] + particles.vy[i] * h, 0), 1);
+    }
+}
+
+void kick(float h) {
+    if (device_resident)
+        PX_device_kick(h);
+    else
+        parallel_for(particles.count, kick_range, &h);
+}
+
+void drift(float h) {
+    if (device_resident)
+        PX_device_drift(h);
+    else
+        parallel_for(particles.count, drift_range, &h);
+}
+
+// Leapfrog is kick-drift-kick, the closing half kick of one step leaves
+// the store forces valid for the opening half kick of the next, so both
+// integrators do one force pass per step. Reordering moves the forces along
+// with the particles, so it keeps them valid.
+void step() {
+    if (sort_interval > 0 && ++steps_since_sort >= sort_interval) {
+        MS_sort(&particles);
+        steps_since_sort = 0;
+    }
+
+    switch (integrator) {
+        case INTEGRATOR_EULER:
+            compute_forces();
+            kick(dt);
+            drift(dt);
+            break;
+        case INTEGRATOR_LEAPFROG:
+            if (!forces_valid) {
+                compute_forces();
+                forces_valid = true;
+            }
+            kick(dt / 2);
+            drift(dt);
+            compute_forces();
+            kick(dt / 2);
+            break;
+    }
+}
+
+void render(const float *x, const float *y) {
+    for (int i = 0; i < particles.count; i++) {
+        SDL_RenderDrawPoint(renderer, (int)(x[i] * SCREEN_WIDTH),
+                (int)(y[i] * SCREEN_HEIGHT));
     }
     if(draw_grid) 
-        for (int i = 0; i < TILES_V; i++) {
-            for (int j = 0; j < TILES_H; j++) {
-                vectorf *t = getTile(i, j);
+        for (int i = 0; i < tiles_v; i++) {
+            for (int j = 0; j < tiles_h; j++) {
                 vectori vi;
-                vi.x = (int)(t->x * SCREEN_WIDTH);
-                vi.y = (int)(t->y * SCREEN_HEIGHT);
+                vi.x = (int)(j * tile_size_H * SCREEN_WIDTH);
+                vi.y = (int)(i * tile_size_V * SCREEN_HEIGHT);
                 SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
                 SDL_RenderDrawLine(renderer, vi.x, vi.y,
                         vi.x + tile_size_H * SCREEN_WIDTH, vi.y);
@@ -214,19 +517,52 @@ void loop() {
                         vi.y + tile_size_V * SCREEN_HEIGHT);
             }
         }
+}
 
+// Runs the physics steps owed since the last frame. With render_every set
+// the clock is ignored and exactly that many steps run between frames.
+void loop() {
+    if (render_every > 0) {
+        for (int k = 0; k < render_every; k++) {
+            step();
+        }
+        steps_done += render_every;
+        return;
+    }
+
+    Uint64 now = SDL_GetPerformanceCounter();
+    step_accumulator += (double)(now - last_counter) / SDL_GetPerformanceFrequency();
+    last_counter = now;
+
+    double step_time = 1.0 / step_rate;
+    int steps = 0;
+    while (step_accumulator >= step_time && steps < MAX_STEPS_PER_FRAME) {
+        step();
+        step_accumulator -= step_time;
+        steps++;
+    }
+    // too slow to keep up, drop the backlog instead of spiralling
+    if (steps == MAX_STEPS_PER_FRAME)
+        step_accumulator = 0;
+    steps_done += steps;
 }
 
+void report_throughput() {
+    Uint64 now = SDL_GetPerformanceCounter();
+    double elapsed = (double)(now - report_counter) / SDL_GetPerformanceFrequency();
+    if (elapsed < 1)
+        return;
 
+    printf("%.1f steps/s, %.1f frames/s\n", steps_done / elapsed, frames_done / elapsed);
+    steps_done = 0;
+    frames_done = 0;
+    report_counter = now;
+}
 
 
-int main(int argc, char **argv) {
-    if(PX_setupCL() != 0)
-        return 1;
 
-    PX_allocate_gpu_buffers(TILES_H, TILES_V);
-    PX_set_gpu_kernel_args(TILES_H, TILES_V);
 
+int main(int argc, char **argv) {
     particle_amount = 100;
     draw_grid = false;
 
@@ -234,8 +570,27 @@ int main(int argc, char **argv) {
     if(isparsed != 0)
         return isparsed;
 
-    particles = malloc(sizeof(vectorf) * particle_amount);
-    accelerations = malloc(sizeof(vectorf) * particle_amount);
+    parallel_init(thread_count, pin_threads);
+
+    tile_size_H = 1.0 / tiles_h;
+    tile_size_V = 1.0 / tiles_v;
+    if (TG_init(tiles_h, tiles_v) != 0)
+        return 1;
+
+    if (engine == ENGINE_PARTICLE_MESH) {
+        if (PM_init(mesh_size, 0) != 0)
+            return 1;
+    } else if (engine == ENGINE_P3M) {
+        if (P3M_init(mesh_size) != 0)
+            return 1;
+    } else if (engine == ENGINE_DIRECT) {
+        DS_init();
+    }
+
+    if (PS_init(&particles, particle_amount, pmass) != 0)
+        return 1;
+    if (sort_interval > 0 && MS_init(particles.capacity) != 0)
+        return 1;
 
     window = SDL_CreateWindow("Test", 200, 200, SCREEN_WIDTH, SCREEN_HEIGHT,
             SDL_WINDOW_OPENGL);
@@ -243,21 +598,67 @@ int main(int argc, char **argv) {
         printf("Error window creation\n");
         return 3;
     }
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+    // throughput mode must not wait for the display between frames
+    renderer = SDL_CreateRenderer(window, -1, render_every > 0 ? 0 : SDL_RENDERER_PRESENTVSYNC);
     wsurface = SDL_GetWindowSurface(window);
 
     start();
+
+    // the backend is picked on the tiles of the starting particles
+    if (engine == ENGINE_TILES) {
+        TG_bin(&particles, assignment);
+        TG_aggregate();
+        // calibration only times the host path, which these flags avoid
+        if (tile_backend == PB_AUTO && (device_resident || bucket_on_gpu)) {
+            printf("Using the OpenCL backend for %s\n",
+                    device_resident ? "-device" : "-bucket gpu");
+            tile_backend = PB_OPENCL;
+        }
+        if (PB_select(tile_backend, tile_levels, tile_level_count, tiles, tile_masses,
+                    tile_forces, tile_kernel) != 0)
+            return 1;
+        if (bucket_on_gpu && pb_active_kind != PB_OPENCL) {
+            printf("Bucketing on the CPU, the tile backend is not OpenCL\n");
+            bucket_on_gpu = false;
+        }
+    }
+
+    if (device_resident && (engine != ENGINE_TILES || pb_active_kind != PB_OPENCL)) {
+        printf("Device resident mode needs the tile engine on the OpenCL backend\n");
+        device_resident = false;
+    }
+    if (device_resident) {
+        // the host copies go stale, so nothing may sort or bucket them
+        PX_device_init(particles.x, particles.y, particles.vx, particles.vy, particles.m,
+                particles.fx, particles.fy, particles.count, assignment);
+        sort_interval = 0;
+    }
+    last_counter = SDL_GetPerformanceCounter();
+    report_counter = last_counter;
     while (1) {
+        loop();
+        // device resident runs draw the previous frame while this one's
+        // steps are still running
+        const float *x = particles.x;
+        const float *y = particles.y;
+        if (device_resident) {
+            PX_device_snapshot();
+            PX_device_positions(&x, &y);
+        }
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderClear(renderer);
         SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-        loop();
+        render(x, y);
         SDL_RenderPresent(renderer);
+        frames_done++;
+        report_throughput();
         SDL_Event e;
         if (SDL_PollEvent(&e) > 0) {
             if (e.type == SDL_QUIT) {
                 break;
             }
+            if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_p && opencl_active())
+                PX_profile_dump();
         }
     }
 
@@ -265,5 +666,16 @@ int main(int argc, char **argv) {
     SDL_DestroyWindow(window);
     SDL_Quit();
 
-    PX_clearCL();
+    if (opencl_active())
+        PX_profile_dump();
+
+    // before TG_clear, zero-copy buffers still refer to the tile arrays
+    PB_clear();
+    BH_clear();
+    PM_clear();
+    P3M_clear();
+    TG_clear();
+    MS_clear();
+    PS_clear(&particles);
+    parallel_clear();
 }
@@ -0,0 +1,169 @@
+#include <string.h>
+
+// Mass assignment and force interpolation between particles and a grid of
+// cols x rows cells over the unit square, nodes sit at the cell centres.
+// NGP puts everything on the nearest node, CIC spreads over the 2x2 nearest
+// and TSC over the 3x3 nearest with quadratic weights. Nodes past the walls
+// are clamped onto the edge, so no mass is lost.
+//
+// Particles are handled in blocks of MA_BLOCK: the stencil (first node and
+// weights) of a whole block is computed in straight loops without branches
+// so they vectorize, then the scatter or gather walks the block.
+
+#define MA_BLOCK 256
+#define MA_MAX_SUPPORT 3
+
+enum mass_assignment_e {
+    ASSIGN_NGP,
+    ASSIGN_CIC,
+    ASSIGN_TSC,
+};
+
+typedef enum mass_assignment_e mass_assignment;
+
+struct ma_stencil_s {
+    int x[MA_BLOCK];
+    int y[MA_BLOCK];
+    float wx[MA_MAX_SUPPORT][MA_BLOCK];
+    float wy[MA_MAX_SUPPORT][MA_BLOCK];
+};
+
+typedef struct ma_stencil_s ma_stencil;
+
+int MA_support(mass_assignment scheme){
+    return scheme == ASSIGN_TSC ? 3 : scheme == ASSIGN_CIC ? 2 : 1;
+}
+
+// Stencil along one axis. u is the position in cells, always >= 0 here, so
+// truncation is a floor.
+void MA_stencil_axis(mass_assignment scheme, const float *u, int count, int *first,
+        float w[MA_MAX_SUPPORT][MA_BLOCK]){
+    switch (scheme) {
+        case ASSIGN_NGP:
+            for (int p = 0; p < count; p++) {
+                first[p] = (int)u[p];
+                w[0][p] = 1;
+            }
+            break;
+        case ASSIGN_CIC:
+            for (int p = 0; p < count; p++) {
+                float v = u[p] + 0.5f;
+                int k = (int)v;
+                float d = v - k;
+                first[p] = k - 1;
+                w[0][p] = 1 - d;
+                w[1][p] = d;
+            }
+            break;
+        case ASSIGN_TSC:
+            for (int p = 0; p < count; p++) {
+                int k = (int)u[p];
+                float d = u[p] - k - 0.5f;
+                first[p] = k - 1;
+                w[0][p] = 0.5f * (0.5f - d) * (0.5f - d);
+                w[1][p] = 0.75f - d * d;
+                w[2][p] = 0.5f * (0.5f + d) * (0.5f + d);
+            }
+            break;
+    }
+}
+
+void MA_stencil_block(mass_assignment scheme, const float *x, const float *y, int count,
+        int cols, int rows, ma_stencil *out){
+    float ux[MA_BLOCK];
+    float uy[MA_BLOCK];
+    for (int p = 0; p < count; p++) {
+        ux[p] = fminf(fmaxf(x[p], 0), 1) * cols;
+        uy[p] = fminf(fmaxf(y[p], 0), 1) * rows;
+    }
+    MA_stencil_axis(scheme, ux, count, out->x, out->wx);
+    MA_stencil_axis(scheme, uy, count, out->y, out->wy);
+}
+
+int MA_clamp(int v, int size){
+    return v < 0 ? 0 : v >= size ? size - 1 : v;
+}
+
+// Adds the particles in [begin, end) of s to out_mass and, if out_moment is
+// given, their mass weighted position to out_moment. Neither is cleared
+// first.
+void MA_deposit(mass_assignment scheme, const particle_store *s, int begin, int end,
+        int cols, int rows, float *out_mass, vectorf *out_moment){
+    int support = MA_support(scheme);
+    ma_stencil stencil;
+
+    for (int base = begin; base < end; base += MA_BLOCK) {
+        int count = end - base < MA_BLOCK ? end - base : MA_BLOCK;
+        const float *x = &s->x[base];
+        const float *y = &s->y[base];
+        const float *mass = &s->m[base];
+        MA_stencil_block(scheme, x, y, count, cols, rows, &stencil);
+
+        for (int p = 0; p < count; p++) {
+            for (int a = 0; a < support; a++) {
+                int row = MA_clamp(stencil.y[p] + a, rows);
+                for (int b = 0; b < support; b++) {
+                    int col = MA_clamp(stencil.x[p] + b, cols);
+                    float m = mass[p] * stencil.wy[a][p] * stencil.wx[b][p];
+                    int k = row * cols + col;
+                    out_mass[k] += m;
+                    if (out_moment != NULL) {
+                        out_moment[k].x += x[p] * m;
+                        out_moment[k].y += y[p] * m;
+                    }
+                }
+            }
+        }
+    }
+}
+
+struct ma_interpolate_job_s {
+    mass_assignment scheme;
+    particle_store *particles;
+    const vectorf *field;
+    int cols;
+    int rows;
+};
+
+typedef struct ma_interpolate_job_s ma_interpolate_job;
+
+void MA_interpolate_range(int begin, int end, int thread, void *ctx){
+    ma_interpolate_job *job = ctx;
+    int support = MA_support(job->scheme);
+    ma_stencil stencil;
+
+    for (int base = begin; base < end; base += MA_BLOCK) {
+        int count = end - base < MA_BLOCK ? end - base : MA_BLOCK;
+        MA_stencil_block(job->scheme, &job->particles->x[base], &job->particles->y[base],
+                count, job->cols, job->rows, &stencil);
+
+        for (int p = 0; p < count; p++) {
+            vectorf f = {0, 0};
+            for (int a = 0; a < support; a++) {
+                int row = MA_clamp(stencil.y[p] + a, job->rows);
+                for (int b = 0; b < support; b++) {
+                    int col = MA_clamp(stencil.x[p] + b, job->cols);
+                    float w = stencil.wy[a][p] * stencil.wx[b][p];
+                    const vectorf *g = &job->field[row * job->cols + col];
+                    f.x += g->x * w;
+                    f.y += g->y * w;
+                }
+            }
+            job->particles->fx[base + p] = f.x;
+            job->particles->fy[base + p] = f.y;
+        }
+    }
+}
+
+// Reads field back into the forces of every particle with the same stencil
+// as MA_deposit, split over the worker threads.
+void MA_interpolate(mass_assignment scheme, particle_store *s, const vectorf *field,
+        int cols, int rows){
+    ma_interpolate_job job;
+    job.scheme = scheme;
+    job.particles = s;
+    job.field = field;
+    job.cols = cols;
+    job.rows = rows;
+    parallel_for(s->count, MA_interpolate_range, &job);
+}
@@ -0,0 +1,184 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Reorders the particle store along a Morton (Z order) curve so particles
+// that are close in space are close in memory. Keys interleave 16 bits of x
+// and y, they are sorted with an LSD radix sort of MS_RADIX_BITS per pass
+// where each chunk of particles is histogrammed and scattered by its own
+// thread, then every array of the store is gathered through the sorted
+// indices.
+
+#define MS_RADIX_BITS 8
+#define MS_BUCKETS (1 << MS_RADIX_BITS)
+#define MS_PASSES (32 / MS_RADIX_BITS)
+
+int ms_capacity;
+uint32_t *ms_keys[2];
+int *ms_index[2];
+float *ms_scratch[7];
+int *ms_histogram;      // MS_BUCKETS counts per chunk, turned into offsets
+
+struct ms_job_s {
+    particle_store *particles;
+    int chunks;
+    int shift;
+    int from;           // which of the ping-pong key buffers holds the input
+};
+
+typedef struct ms_job_s ms_job;
+
+int MS_init(int capacity){
+    ms_capacity = capacity;
+    for (int b = 0; b < 2; b++) {
+        ms_keys[b] = malloc(sizeof(uint32_t) * capacity);
+        ms_index[b] = malloc(sizeof(int) * capacity);
+        if (ms_keys[b] == NULL || ms_index[b] == NULL) {
+            fprintf(stderr, "Morton sort: out of memory\n");
+            return 1;
+        }
+    }
+    for (int a = 0; a < 7; a++) {
+        ms_scratch[a] = PS_alloc(capacity);
+    }
+    ms_histogram = malloc(sizeof(int) * MS_BUCKETS * parallel_threads);
+    if (ms_histogram == NULL) {
+        fprintf(stderr, "Morton sort: out of memory\n");
+        return 1;
+    }
+    return 0;
+}
+
+// spreads the low 16 bits of v to the even bits
+uint32_t MS_spread(uint32_t v){
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+uint32_t MS_key(float x, float y){
+    uint32_t ix = (uint32_t)(fminf(fmaxf(x, 0), 1) * 65535.0f);
+    uint32_t iy = (uint32_t)(fminf(fmaxf(y, 0), 1) * 65535.0f);
+    return MS_spread(ix) | (MS_spread(iy) << 1);
+}
+
+void MS_chunk(const ms_job *job, int chunk, int *begin, int *end){
+    int count = job->particles->count;
+    *begin = (long)count * chunk / job->chunks;
+    *end = (long)count * (chunk + 1) / job->chunks;
+}
+
+void MS_compute_keys(int begin, int end, int thread, void *ctx){
+    ms_job *job = ctx;
+    for (int i = begin; i < end; i++) {
+        ms_keys[0][i] = MS_key(job->particles->x[i], job->particles->y[i]);
+        ms_index[0][i] = i;
+    }
+}
+
+void MS_count(int begin, int end, int thread, void *ctx){
+    ms_job *job = ctx;
+    const uint32_t *keys = ms_keys[job->from];
+    for (int c = begin; c < end; c++) {
+        int *histogram = &ms_histogram[c * MS_BUCKETS];
+        memset(histogram, 0, sizeof(int) * MS_BUCKETS);
+        int first, last;
+        MS_chunk(job, c, &first, &last);
+        for (int i = first; i < last; i++) {
+            histogram[(keys[i] >> job->shift) & (MS_BUCKETS - 1)]++;
+        }
+    }
+}
+
+// Stable within a chunk and chunks are laid out in order, so the whole pass
+// is stable as LSD needs.
+void MS_scatter(int begin, int end, int thread, void *ctx){
+    ms_job *job = ctx;
+    const uint32_t *keys = ms_keys[job->from];
+    const int *index = ms_index[job->from];
+    uint32_t *out_keys = ms_keys[!job->from];
+    int *out_index = ms_index[!job->from];
+    for (int c = begin; c < end; c++) {
+        int *offset = &ms_histogram[c * MS_BUCKETS];
+        int first, last;
+        MS_chunk(job, c, &first, &last);
+        for (int i = first; i < last; i++) {
+            int k = offset[(keys[i] >> job->shift) & (MS_BUCKETS - 1)]++;
+            out_keys[k] = keys[i];
+            out_index[k] = index[i];
+        }
+    }
+}
+
+void MS_gather(int begin, int end, int thread, void *ctx){
+    ms_job *job = ctx;
+    particle_store *s = job->particles;
+    float *arrays[7] = {s->x, s->y, s->vx, s->vy, s->m, s->fx, s->fy};
+    const int *index = ms_index[job->from];
+    for (int a = 0; a < 7; a++) {
+        for (int i = begin; i < end; i++) {
+            ms_scratch[a][i] = arrays[a][index[i]];
+        }
+    }
+}
+
+// Sorts every array of s by the Morton key of its position. Buffers are
+// swapped with the scratch ones rather than copied back.
+void MS_sort(particle_store *s){
+    if (s->capacity > ms_capacity) {
+        fprintf(stderr, "Morton sort: store larger than initialised for\n");
+        return;
+    }
+
+    ms_job job;
+    job.particles = s;
+    job.chunks = s->count < parallel_threads ? s->count : parallel_threads;
+    job.from = 0;
+    parallel_for(s->count, MS_compute_keys, &job);
+
+    for (int pass = 0; pass < MS_PASSES; pass++) {
+        job.shift = pass * MS_RADIX_BITS;
+        parallel_for(job.chunks, MS_count, &job);
+
+        // exclusive prefix over digits first, chunks second
+        int total = 0;
+        for (int d = 0; d < MS_BUCKETS; d++) {
+            for (int c = 0; c < job.chunks; c++) {
+                int n = ms_histogram[c * MS_BUCKETS + d];
+                ms_histogram[c * MS_BUCKETS + d] = total;
+                total += n;
+            }
+        }
+
+        parallel_for(job.chunks, MS_scatter, &job);
+        job.from = !job.from;
+    }
+
+    parallel_for(s->count, MS_gather, &job);
+    float **arrays[7] = {&s->x, &s->y, &s->vx, &s->vy, &s->m, &s->fx, &s->fy};
+    for (int a = 0; a < 7; a++) {
+        float *t = *arrays[a];
+        *arrays[a] = ms_scratch[a];
+        ms_scratch[a] = t;
+    }
+}
+
+void MS_clear(){
+    for (int b = 0; b < 2; b++) {
+        free(ms_keys[b]);
+        free(ms_index[b]);
+        ms_keys[b] = NULL;
+        ms_index[b] = NULL;
+    }
+    for (int a = 0; a < 7; a++) {
+        free(ms_scratch[a]);
+        ms_scratch[a] = NULL;
+    }
+    free(ms_histogram);
+    ms_histogram = NULL;
+    ms_capacity = 0;
+}
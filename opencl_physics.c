@@ -1,20 +1,146 @@
 
 #include <CL/cl.h>
 #include <CL/cl_platform.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #define ASSERT_NOERROR(err) if (err != CL_SUCCESS) { fprintf(stderr, "OpenCL error %d at line %d\n", err, __LINE__); exit(EXIT_FAILURE); }
 #define PRINT_ERROR(err) if (err != CL_SUCCESS) { fprintf(stderr, "OpenCL error %d at line %d\n", err, __LINE__); }
 
+#define PX_SYMMETRIC_BLOCK 64
+#define PX_FLAT_BLOCK 128
+#define PX_TUNE_RUNS 3
+#define PX_MAX_VARIANTS 16
+#define PX_MAX_HELPERS 7
+#define PX_SPLIT_ALIGN 256          // tiles, slices are whole multiples of it
+#define PX_PROFILE_WINDOW 512      // samples kept per statistic
+#define PX_PROFILE_PENDING 64      // events recorded but not read yet
+#define PX_SCAN_GROUP 256
+#define PX_MAX_LEVELS 32
+
+enum px_kernel_e {
+    PX_KERNEL_HIERARCHICAL,
+    PX_KERNEL_FLAT,
+    PX_KERNEL_SYMMETRIC,
+};
+
+typedef enum px_kernel_e px_kernel;
+
+enum px_zero_copy_e {
+    PX_ZERO_COPY_AUTO,     // when the device shares memory with the host
+    PX_ZERO_COPY_ON,
+    PX_ZERO_COPY_OFF,
+};
+
+typedef enum px_zero_copy_e px_zero_copy_mode;
+
 cl_kernel clkernel;
+cl_kernel clkernel_hierarchical;
+cl_kernel clkernel_symmetric;
+cl_kernel clkernel_reduce;
+cl_kernel clkernel_bucket_count;
+cl_kernel clkernel_bucket_scan;
+cl_kernel clkernel_bucket_scatter;
+cl_kernel clkernel_deposit;
+cl_kernel clkernel_finalize;
+cl_kernel clkernel_aggregate;
+cl_kernel clkernel_interpolate;
+cl_kernel clkernel_kick;
+cl_kernel clkernel_drift;
 cl_program clprogram;
-cl_command_queue clqueue;
+cl_command_queue clqueue;      // kernels
+cl_command_queue clqueue_io;   // host transfers, ordered against clqueue by events
 cl_context clcontext;
 cl_device_id cldevice;
 
 cl_mem gpu_tiles;
 cl_mem gpu_masses;
+cl_mem gpu_levels;
 cl_mem gpu_out_forces;
+cl_mem gpu_partial_forces;
+
+// particle bucketing, grown on demand by PX_bucket_particles
+cl_mem gpu_bucket_x;
+cl_mem gpu_bucket_y;
+cl_mem gpu_bucket_tiles;       // tile of every particle
+cl_mem gpu_bucket_particles;
+cl_mem gpu_bucket_counts;      // per tile counts, then write cursors
+cl_mem gpu_bucket_start;
+int px_bucket_capacity;
+int px_bucket_tile_capacity;
+
+// Zero-copy keeps the tile arrays in the OpenCL buffers (CL_MEM_USE_HOST_PTR)
+// and moves them between host and device by mapping instead of copying.
+// Between steps they are mapped for the host.
+px_zero_copy_mode px_zero_copy_request = PX_ZERO_COPY_AUTO;
+bool px_zero_copy;
+bool px_unified_memory;
+bool px_tiles_mapped;
+int px_tile_count;
+void *px_host_tiles;
+void *px_host_masses;
+void *px_host_forces;
+
+// the host tile upload the next tile kernel waits for and that kernel's
+// completion, which the download waits for
+cl_event px_upload_events[3];
+int px_upload_event_count;
+cl_event px_compute_event;
+
+// device resident particles, see PX_device_init
+cl_mem gpu_px;
+cl_mem gpu_py;
+cl_mem gpu_pvx;
+cl_mem gpu_pvy;
+cl_mem gpu_pm;
+cl_mem gpu_pfx;
+cl_mem gpu_pfy;
+cl_mem gpu_moments;
+int px_particle_count;
+bool px_device_ready;
+
+// two position snapshots, one being read back while the other is drawn
+cl_mem gpu_snapshot_x[2];
+cl_mem gpu_snapshot_y[2];
+float *px_snapshot_x[2];
+float *px_snapshot_y[2];
+cl_event px_snapshot_read[2];
+bool px_snapshot_mapped[2];     // zero-copy snapshots are mapped, not read
+long px_snapshot_frames;
+
+cl_int4 px_levels[PX_MAX_LEVELS];
+int px_level_count;
+
+int px_symmetric_block;
+cl_ulong px_max_alloc;             // CL_DEVICE_MAX_MEM_ALLOC_SIZE of cldevice
+bool px_symmetric_warned;
+int px_flat_block;
+int px_flat_unroll;            // 0 leaves unrolling to the compiler
+int px_hierarchical_group;     // 0 leaves the local size to the runtime
+bool px_retune;
+
+// Programs built with extra -D options, kept for reuse. Kernels hold their
+// own reference, so replacing an entry never breaks one in use.
+struct px_variant_s {
+    char options[256];
+    cl_program program;
+};
+
+typedef struct px_variant_s px_variant;
+
+px_variant px_variants[PX_MAX_VARIANTS];
+int px_variant_count;
+int px_variant_next;           // entry replaced once the table is full
+char px_options[256];          // specialisation of the current grid, empty for none
+bool px_fast_math;
+int px_scan_group;
 
 // Function to get OpenCL device info
 void print_device_info(cl_device_id device) {
@@ -36,11 +162,477 @@ void print_device_info(cl_device_id device) {
 
 
 
+void PX_release_events(cl_event *events, int count){
+    for (int i = 0; i < count; i++) {
+        if (events[i] != NULL)
+            clReleaseEvent(events[i]);
+        events[i] = NULL;
+    }
+}
+
+// Profiling of the tile step. Every enqueue of PX_upload, PX_step and
+// PX_download hands its event to PX_profile_record, the timestamps are read
+// once the event completes and kept in a rolling window per statistic.
+enum px_stat_e {
+    PX_STAT_WRITE_TILES,
+    PX_STAT_WRITE_MASSES,
+    PX_STAT_KERNEL,
+    PX_STAT_REDUCE,
+    PX_STAT_READ_FORCES,
+    PX_STAT_COUNT,
+};
+
+typedef enum px_stat_e px_stat;
+
+struct px_profile_stat_s {
+    float run[PX_PROFILE_WINDOW];      // start to end, ms
+    float wait[PX_PROFILE_WINDOW];     // queued to start, ms
+    int count;
+    int next;
+    long total;
+};
+
+typedef struct px_profile_stat_s px_profile_stat;
+
+struct px_profile_pending_s {
+    px_stat stat;
+    cl_event event;
+};
+
+typedef struct px_profile_pending_s px_profile_pending;
+
+const char *px_stat_names[PX_STAT_COUNT] = {
+    [PX_STAT_WRITE_TILES] = "write tiles",
+    [PX_STAT_WRITE_MASSES] = "write masses",
+    [PX_STAT_KERNEL] = "force kernel",
+    [PX_STAT_REDUCE] = "reduce",
+    [PX_STAT_READ_FORCES] = "read forces",
+};
+
+bool px_profiling;
+cl_event px_symmetric_pass;        // the pass before the reduction, when profiling
+px_profile_stat px_profile_stats[PX_STAT_COUNT];
+px_profile_pending px_profile_pending_events[PX_PROFILE_PENDING];
+int px_profile_pending_count;
+
+void PX_profile_sample(px_stat stat, cl_event event){
+    cl_ulong queued, start, end;
+    if (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued,
+                NULL) != CL_SUCCESS
+            || clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start,
+                NULL) != CL_SUCCESS
+            || clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end,
+                NULL) != CL_SUCCESS)
+        return;
+
+    px_profile_stat *s = &px_profile_stats[stat];
+    s->run[s->next] = (end - start) * 1e-6f;
+    s->wait[s->next] = (start - queued) * 1e-6f;
+    s->next = (s->next + 1) % PX_PROFILE_WINDOW;
+    if (s->count < PX_PROFILE_WINDOW)
+        s->count++;
+    s->total++;
+}
+
+// Reads every recorded event that has completed, or waits for all of them.
+void PX_profile_collect(bool wait){
+    int kept = 0;
+    for (int p = 0; p < px_profile_pending_count; p++) {
+        px_profile_pending *pending = &px_profile_pending_events[p];
+        cl_int status = CL_COMPLETE;
+        if (wait) {
+            clWaitForEvents(1, &pending->event);
+        } else {
+            clGetEventInfo(pending->event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status),
+                    &status, NULL);
+        }
+        // negative statuses are errors, the event will not get timestamps
+        if (status > CL_COMPLETE) {
+            px_profile_pending_events[kept++] = *pending;
+            continue;
+        }
+        if (status == CL_COMPLETE)
+            PX_profile_sample(pending->stat, pending->event);
+        clReleaseEvent(pending->event);
+    }
+    px_profile_pending_count = kept;
+}
+
+// Keeps a reference to event until its timestamps are read.
+void PX_profile_record(px_stat stat, cl_event event){
+    if (!px_profiling || event == NULL)
+        return;
+    if (px_profile_pending_count == PX_PROFILE_PENDING)
+        PX_profile_collect(true);
+    clRetainEvent(event);
+    px_profile_pending_events[px_profile_pending_count].stat = stat;
+    px_profile_pending_events[px_profile_pending_count].event = event;
+    px_profile_pending_count++;
+}
+
+int PX_compare_floats(const void *a, const void *b){
+    float x = *(const float*)a;
+    float y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+// Prints min, average and 99th percentile of every statistic over its
+// window, once everything enqueued so far is done.
+void PX_profile_dump(){
+    if (!px_profiling)
+        return;
+    clFinish(clqueue_io);
+    clFinish(clqueue);
+    PX_profile_collect(true);
+
+    printf("%-14s %8s %10s %10s %10s %10s\n", "OpenCL", "samples", "min ms", "avg ms",
+            "p99 ms", "wait ms");
+    for (int k = 0; k < PX_STAT_COUNT; k++) {
+        px_profile_stat *s = &px_profile_stats[k];
+        if (s->count == 0)
+            continue;
+        float sorted[PX_PROFILE_WINDOW];
+        double run = 0, wait = 0;
+        for (int i = 0; i < s->count; i++) {
+            sorted[i] = s->run[i];
+            run += s->run[i];
+            wait += s->wait[i];
+        }
+        qsort(sorted, s->count, sizeof(float), PX_compare_floats);
+        int p99 = (s->count * 99 + 99) / 100 - 1;
+        printf("%-14s %8ld %10.3f %10.3f %10.3f %10.3f\n", px_stat_names[k], s->total,
+                sorted[0], run / s->count, sorted[p99], wait / s->count);
+    }
+}
+
+void PX_profile_reset(){
+    for (int p = 0; p < px_profile_pending_count; p++) {
+        clReleaseEvent(px_profile_pending_events[p].event);
+    }
+    px_profile_pending_count = 0;
+    memset(px_profile_stats, 0, sizeof(px_profile_stats));
+}
+
+// Maps the zero-copy tile buffers for the host once the wait list is done:
+// positions and masses to be overwritten, forces to be read.
+void PX_map_tiles(cl_uint wait_count, const cl_event *wait){
+    cl_int e1, e2, e3;
+    clEnqueueMapBuffer(clqueue_io, gpu_tiles, CL_FALSE, CL_MAP_WRITE_INVALIDATE_REGION, 0,
+            sizeof(cl_float2) * px_tile_count, wait_count, wait, NULL, &e1);
+    clEnqueueMapBuffer(clqueue_io, gpu_masses, CL_FALSE, CL_MAP_WRITE_INVALIDATE_REGION, 0,
+            sizeof(cl_float) * px_tile_count, wait_count, wait, NULL, &e2);
+    // the queue is in order, blocking on the last map covers all three
+    clEnqueueMapBuffer(clqueue_io, gpu_out_forces, CL_TRUE, CL_MAP_READ, 0,
+            sizeof(cl_float2) * px_tile_count, wait_count, wait, NULL, &e3);
+    ASSERT_NOERROR(e1);
+    ASSERT_NOERROR(e2);
+    ASSERT_NOERROR(e3);
+    px_tiles_mapped = true;
+}
+
+// Hands the zero-copy tile buffers back to the device, done gets one event
+// per buffer.
+void PX_unmap_tiles(cl_event *done){
+    cl_int e1, e2, e3;
+    e1 = clEnqueueUnmapMemObject(clqueue_io, gpu_tiles, px_host_tiles, 0, NULL,
+            done != NULL ? &done[0] : NULL);
+    e2 = clEnqueueUnmapMemObject(clqueue_io, gpu_masses, px_host_masses, 0, NULL,
+            done != NULL ? &done[1] : NULL);
+    e3 = clEnqueueUnmapMemObject(clqueue_io, gpu_out_forces, px_host_forces, 0, NULL,
+            done != NULL ? &done[2] : NULL);
+    ASSERT_NOERROR(e1);
+    ASSERT_NOERROR(e2);
+    ASSERT_NOERROR(e3);
+    px_tiles_mapped = false;
+}
+
+// The kernel source is built into the executable, so the program runs from
+// any directory. A calculate_force_kernel.cl in the working directory still
+// takes precedence, which keeps editing the kernels quick.
+//
+// .incbin resolves PX_KERNEL_FILE against the assembler's working directory
+// and its -I paths, not against this file. Compile from the source
+// directory, or from elsewhere add -Wa,-I<source directory> or define
+// PX_KERNEL_FILE as the full path.
+#ifndef PX_KERNEL_FILE
+#define PX_KERNEL_FILE "calculate_force_kernel.cl"
+#endif
+
+__asm__(
+    ".section .rodata\n"
+    ".global px_embedded_source\n"
+    "px_embedded_source:\n"
+    ".incbin \"" PX_KERNEL_FILE "\"\n"
+    ".global px_embedded_source_end\n"
+    "px_embedded_source_end:\n"
+    ".byte 0\n"
+    ".previous\n"
+);
+
+extern const char px_embedded_source[];
+extern const char px_embedded_source_end[];
+
+// Returns a malloc'd copy of the kernel source and its length.
+char *PX_kernel_source(size_t *size){
+    FILE *fptr = fopen("calculate_force_kernel.cl", "rb");
+    if (fptr != NULL) {
+        fseek(fptr, 0, SEEK_END);
+        *size = ftell(fptr);
+        fseek(fptr, 0, SEEK_SET);
+        char *source = malloc(*size + 1);
+        *size = fread(source, 1, *size, fptr);
+        source[*size] = 0;
+        fclose(fptr);
+        return source;
+    }
+
+    *size = px_embedded_source_end - px_embedded_source;
+    char *source = malloc(*size + 1);
+    memcpy(source, px_embedded_source, *size);
+    source[*size] = 0;
+    return source;
+}
+
+uint64_t PX_hash(uint64_t h, const void *data, size_t size){
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        h ^= bytes[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// $XDG_CACHE_HOME/particles or ~/.cache/particles, created if needed.
+// Returns 1 when there is nowhere to put it.
+int PX_cache_dir(char *base, size_t size){
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg != NULL && xdg[0] != 0) {
+        snprintf(base, size, "%s", xdg);
+    } else if (home != NULL && home[0] != 0) {
+        snprintf(base, size, "%s/.cache", home);
+        mkdir(base, 0755);
+    } else {
+        return 1;
+    }
+    strncat(base, "/particles", size - strlen(base) - 1);
+    if (mkdir(base, 0755) != 0 && errno != EEXIST)
+        return 1;
+    return 0;
+}
+
+// Hash of what identifies a device and its driver.
+uint64_t PX_device_hash(cl_device_id device_id){
+    char device[256] = {0}, driver[256] = {0}, version[256] = {0};
+    clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(device) - 1, device, NULL);
+    clGetDeviceInfo(device_id, CL_DRIVER_VERSION, sizeof(driver) - 1, driver, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_VERSION, sizeof(version) - 1, version, NULL);
+
+    uint64_t h = 0xcbf29ce484222325ull;
+    h = PX_hash(h, device, strlen(device) + 1);
+    h = PX_hash(h, driver, strlen(driver) + 1);
+    h = PX_hash(h, version, strlen(version) + 1);
+    return h;
+}
+
+// Binaries are stored one file per hash of device, driver, build options
+// and source.
+int PX_cache_path(char *path, size_t size, cl_device_id device, const char *options,
+        const char *source, size_t source_size){
+    char base[512];
+    if (PX_cache_dir(base, sizeof(base)) != 0)
+        return 1;
+
+    uint64_t h = PX_device_hash(device);
+    h = PX_hash(h, options, strlen(options) + 1);
+    h = PX_hash(h, source, source_size);
+    snprintf(path, size, "%s/%016llx.bin", base, (unsigned long long)h);
+    return 0;
+}
+
+void PX_print_build_log(cl_program program, cl_device_id device){
+    size_t length = 0;
+    if (clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &length)
+            != CL_SUCCESS || length == 0)
+        return;
+    char *log = malloc(length);
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, length, log, NULL);
+    fprintf(stderr, "%s\n", log);
+    free(log);
+}
+
+cl_program PX_load_binary(cl_context context, cl_device_id device, const char *path,
+        const char *options){
+    FILE *fptr = fopen(path, "rb");
+    if (fptr == NULL)
+        return NULL;
+    fseek(fptr, 0, SEEK_END);
+    long end = ftell(fptr);
+    if (end <= 0) {
+        fclose(fptr);
+        return NULL;
+    }
+    fseek(fptr, 0, SEEK_SET);
+    size_t size = end;
+    unsigned char *binary = malloc(size);
+    size = fread(binary, 1, size, fptr);
+    fclose(fptr);
+
+    const unsigned char *const_binary = binary;
+    cl_int status, e1;
+    cl_program program = clCreateProgramWithBinary(context, 1, &device, &size,
+            &const_binary, &status, &e1);
+    free(binary);
+    // a stale binary, e.g. after a driver update, can still create a program
+    if (e1 != CL_SUCCESS || status != CL_SUCCESS) {
+        if (program != NULL)
+            clReleaseProgram(program);
+        return NULL;
+    }
+    if (clBuildProgram(program, 1, &device, options, NULL, NULL) != CL_SUCCESS) {
+        clReleaseProgram(program);
+        return NULL;
+    }
+    return program;
+}
+
+// Written to a temporary name and renamed, so a concurrent start never
+// reads half a binary.
+void PX_save_binary(cl_program program, const char *path){
+    size_t size = 0;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL)
+            != CL_SUCCESS || size == 0)
+        return;
+    unsigned char *binary = malloc(size);
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL)
+            == CL_SUCCESS) {
+        char temporary[600];
+        snprintf(temporary, sizeof(temporary), "%s.%d", path, (int)getpid());
+        FILE *fptr = fopen(temporary, "wb");
+        if (fptr != NULL) {
+            bool written = fwrite(binary, 1, size, fptr) == size;
+            if (fclose(fptr) == 0 && written) {
+                rename(temporary, path);
+            } else {
+                remove(temporary);
+            }
+        }
+    }
+    free(binary);
+}
+
+// Builds the kernels for device with the given options, from the binary
+// cache when it has a matching entry and from source otherwise.
+cl_program PX_build_program_on(cl_context context, cl_device_id device, const char *options){
+    size_t source_size;
+    char *source = PX_kernel_source(&source_size);
+    char path[600];
+    bool cached = PX_cache_path(path, sizeof(path), device, options, source, source_size) == 0;
+
+    cl_program program = cached ? PX_load_binary(context, device, path, options) : NULL;
+    if (program != NULL) {
+        free(source);
+        return program;
+    }
+
+    const char *const_source = source;
+    cl_int e1;
+    program = clCreateProgramWithSource(context, 1, &const_source, &source_size, &e1);
+    free(source);
+    ASSERT_NOERROR(e1);
+
+    cl_int e2 = clBuildProgram(program, 1, &device, options, NULL, NULL);
+    PRINT_ERROR(e2);
+    if (e2 != CL_SUCCESS) {
+        PX_print_build_log(program, device);
+        clReleaseProgram(program);
+        return NULL;
+    }
+    if (cached)
+        PX_save_binary(program, path);
+    return program;
+}
+
+cl_program PX_build_program(const char *options){
+    return PX_build_program_on(clcontext, cldevice, options);
+}
+
+// The program built with options, from the variant table if it is there.
+cl_program PX_program_variant(const char *options){
+    if (options[0] == 0)
+        return clprogram;
+    for (int v = 0; v < px_variant_count; v++) {
+        if (strcmp(px_variants[v].options, options) == 0)
+            return px_variants[v].program;
+    }
+
+    cl_program program = PX_build_program(options);
+    if (program == NULL)
+        return NULL;
+    int v;
+    if (px_variant_count < PX_MAX_VARIANTS) {
+        v = px_variant_count++;
+    } else {
+        v = px_variant_next;
+        px_variant_next = (v + 1) % PX_MAX_VARIANTS;
+        clReleaseProgram(px_variants[v].program);
+    }
+    snprintf(px_variants[v].options, sizeof(px_variants[v].options), "%s", options);
+    px_variants[v].program = program;
+    return program;
+}
+
+cl_int PX_replace_kernel(cl_kernel *kernel, cl_program program, const char *name){
+    cl_int e1;
+    cl_kernel replacement = clCreateKernel(program, name, &e1);
+    if (e1 != CL_SUCCESS)
+        return e1;
+    clReleaseKernel(*kernel);
+    *kernel = replacement;
+    return CL_SUCCESS;
+}
+
+// Rebuilds the tile force kernels with the force law and the grid as
+// compile-time constants, so the device compiler can fold them and unroll
+// the level loop. Keeps the generic kernels if the build fails, and returns
+// the error if the built program is missing a kernel.
+cl_int PX_specialize(float force_k, float min_dist, const cl_int4 *levels, int level_count){
+    snprintf(px_options, sizeof(px_options),
+            "-D FORCE_K=%.9ef -D FORCE_MIN_DIST=%.9ef -D GRID_COLS=%d -D GRID_ROWS=%d"
+            " -D LEVEL_COUNT=%d%s",
+            force_k, min_dist, levels[0].s[0], levels[0].s[1], level_count,
+            px_fast_math ? " -cl-fast-relaxed-math" : "");
+
+    cl_program program = PX_program_variant(px_options);
+    if (program == NULL) {
+        fprintf(stderr, "Specialised kernel build failed, using the generic kernels\n");
+        px_options[0] = 0;
+        return CL_SUCCESS;
+    }
+    cl_int e1 = PX_replace_kernel(&clkernel, program, "calculate_force");
+    if (e1 == CL_SUCCESS)
+        e1 = PX_replace_kernel(&clkernel_hierarchical, program, "calculate_force_hierarchical");
+    if (e1 == CL_SUCCESS)
+        e1 = PX_replace_kernel(&clkernel_symmetric, program, "calculate_force_symmetric");
+    if (e1 == CL_SUCCESS)
+        e1 = PX_replace_kernel(&clkernel_reduce, program, "reduce_partial_forces");
+    px_flat_unroll = 0;
+    return e1;
+}
+
+// Returns non-zero without touching any OpenCL state beyond the query if
+// there is no platform with a GPU device, so the caller can fall back to
+// the CPU.
 int PX_setupCL(){
     cl_platform_id platforms[64];
     unsigned int platformcount;
     cl_int e1 = clGetPlatformIDs(64, platforms, &platformcount);
-    ASSERT_NOERROR(e1);
+    if (e1 != CL_SUCCESS || platformcount == 0) {
+        fprintf(stderr, "No OpenCL platform found (error %d)\n", e1);
+        return 1;
+    }
+
+    bool found = false;
 
     for (int i = 0; i < platformcount; i++) {
         cl_device_id devices[64];
@@ -53,7 +645,7 @@ int PX_setupCL(){
                 &devicecount
                 );
 
-        if(deviceresult != CL_SUCCESS)
+        if(deviceresult != CL_SUCCESS || devicecount == 0)
             continue;
 
         char name[128];
@@ -68,6 +660,18 @@ int PX_setupCL(){
 
 
         cldevice = devices[0];
+        found = true;
+
+        cl_bool unified = CL_FALSE;
+        clGetDeviceInfo(cldevice, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified), &unified, NULL);
+        px_unified_memory = unified;
+        clGetDeviceInfo(cldevice, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(px_max_alloc),
+                &px_max_alloc, NULL);
+    }
+
+    if (!found) {
+        fprintf(stderr, "No OpenCL GPU device found\n");
+        return 1;
     }
 
     cl_int e6;
@@ -75,78 +679,364 @@ int PX_setupCL(){
     ASSERT_NOERROR(e6);
 
     cl_int e2;
-    clqueue = clCreateCommandQueueWithProperties(clcontext, cldevice, NULL, &e2);
+    cl_queue_properties profiled[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
+    clqueue = clCreateCommandQueueWithProperties(clcontext, cldevice,
+            px_profiling ? profiled : NULL, &e2);
+    ASSERT_NOERROR(e2);
+    clqueue_io = clCreateCommandQueueWithProperties(clcontext, cldevice,
+            px_profiling ? profiled : NULL, &e2);
     ASSERT_NOERROR(e2);
 
-    FILE *fptr;
-    fptr = fopen("calculate_force_kernel.cl", "r");
-    ASSERT_NOERROR(fptr == NULL);
-
-    fseek(fptr, 0, SEEK_END);
-    size_t program_size = ftell(fptr);
-    fseek(fptr, 0, SEEK_SET);
-    char *program_source = malloc(program_size + 1); 
-    fread(program_source, program_size, 1, fptr);
-    fclose(fptr);
-
-    const char *const_program_source = program_source;    
-
-    cl_int e3;
-    cl_program program = clCreateProgramWithSource(clcontext, 1, &const_program_source, &program_size, 
-            &e3);
-    ASSERT_NOERROR(e3);
-    //free(program_source);
-
-    cl_int e4 = clBuildProgram(program, 1, &cldevice, NULL, NULL, NULL);
-    PRINT_ERROR(e4);
-    if(e4 != CL_SUCCESS){
-        char log[1024];
-        size_t logLength;
-        cl_int programbuildErrorresult = clGetProgramBuildInfo(program, 
-                cldevice, 
-                CL_PROGRAM_BUILD_LOG, 
-                1024, 
-                log, 
-                &logLength);
-
-        ASSERT_NOERROR(programbuildErrorresult);
-
-        if(programbuildErrorresult == CL_SUCCESS){
-            printf("%s", log);
-        }
+    cl_program program = PX_build_program("");
+    if (program == NULL) {
+        clReleaseCommandQueue(clqueue);
+        clReleaseCommandQueue(clqueue_io);
+        clReleaseContext(clcontext);
         return 1;
     }
+    clprogram = program;
 
     cl_int e5;
     clkernel = clCreateKernel(program, "calculate_force", &e5);
     ASSERT_NOERROR(e5);
+    clkernel_hierarchical = clCreateKernel(program, "calculate_force_hierarchical", &e5);
+    ASSERT_NOERROR(e5);
+    clkernel_symmetric = clCreateKernel(program, "calculate_force_symmetric", &e5);
+    ASSERT_NOERROR(e5);
+    clkernel_reduce = clCreateKernel(program, "reduce_partial_forces", &e5);
+    ASSERT_NOERROR(e5);
+    clkernel_bucket_count = clCreateKernel(program, "bucket_count", &e5);
+    ASSERT_NOERROR(e5);
+    clkernel_bucket_scan = clCreateKernel(program, "bucket_scan", &e5);
+    ASSERT_NOERROR(e5);
+    clkernel_bucket_scatter = clCreateKernel(program, "bucket_scatter", &e5);
+    ASSERT_NOERROR(e5);
+    clkernel_deposit = clCreateKernel(program, "deposit_particles", &e5);
+    ASSERT_NOERROR(e5);
+    clkernel_finalize = clCreateKernel(program, "finalize_tiles", &e5);
+    ASSERT_NOERROR(e5);
+    clkernel_aggregate = clCreateKernel(program, "aggregate_level", &e5);
+    ASSERT_NOERROR(e5);
+    clkernel_interpolate = clCreateKernel(program, "interpolate_forces", &e5);
+    ASSERT_NOERROR(e5);
+    clkernel_kick = clCreateKernel(program, "kick_particles", &e5);
+    ASSERT_NOERROR(e5);
+    clkernel_drift = clCreateKernel(program, "drift_particles", &e5);
+    ASSERT_NOERROR(e5);
+
+    size_t max_group;
+    clGetKernelWorkGroupInfo(clkernel_symmetric, cldevice, CL_KERNEL_WORK_GROUP_SIZE,
+            sizeof(max_group), &max_group, NULL);
+    px_symmetric_block = PX_SYMMETRIC_BLOCK;
+    while (px_symmetric_block > max_group) {
+        px_symmetric_block /= 2;
+    }
+
+    clGetKernelWorkGroupInfo(clkernel, cldevice, CL_KERNEL_WORK_GROUP_SIZE,
+            sizeof(max_group), &max_group, NULL);
+    px_flat_block = PX_FLAT_BLOCK;
+    while (px_flat_block > max_group) {
+        px_flat_block /= 2;
+    }
+
+    clGetKernelWorkGroupInfo(clkernel_bucket_scan, cldevice, CL_KERNEL_WORK_GROUP_SIZE,
+            sizeof(max_group), &max_group, NULL);
+    px_scan_group = max_group < PX_SCAN_GROUP ? max_group : PX_SCAN_GROUP;
 
     print_device_info(cldevice);
 
     return 0;
 }
 
-int PX_allocate_gpu_buffers(int tile_h, int tile_v){
-    int tiles = tile_h * tile_v;
-    cl_int e1, e2, e3, e4, e5;
-    gpu_tiles = clCreateBuffer(clcontext, CL_MEM_READ_ONLY, sizeof(cl_float2) * tiles, NULL, &e1);
-    gpu_masses = clCreateBuffer(clcontext, CL_MEM_READ_ONLY, sizeof(float) * tiles, NULL, &e2);
-    gpu_out_forces = clCreateBuffer(clcontext, CL_MEM_WRITE_ONLY, sizeof(cl_float2) * tiles, NULL, &e5);
+// Whole work-groups over [begin, end) when group is set, the flat kernel
+// needs every item at its barriers. Items past end compute tiles another
+// device owns, their results are never read.
+cl_int PX_enqueue_range(cl_command_queue queue, cl_kernel kernel, int group, int begin,
+        int end, cl_uint wait_count, const cl_event *wait, cl_event *done){
+    size_t offset = begin;
+    size_t localWorkSize = group;
+    size_t globalWorkSize = end - begin;
+    if (group > 0)
+        globalWorkSize = (globalWorkSize + localWorkSize - 1) / localWorkSize * localWorkSize;
+    return clEnqueueNDRangeKernel(queue, kernel, 1, &offset, &globalWorkSize,
+            group > 0 ? &localWorkSize : NULL, wait_count, wait, done);
+}
 
-    ASSERT_NOERROR(e1);
-    ASSERT_NOERROR(e2);
-    ASSERT_NOERROR(e5);
+// Further devices that share the host tile step. Each has its own context,
+// since devices of different platforms cannot share one, and computes the
+// level 0 forces of its slice px_split[d]..px_split[d + 1], d = 0 being
+// cldevice. Only the flat and hierarchical kernels are split, the symmetric
+// one pairs tiles across any slice boundary.
+struct px_helper_s {
+    char name[128];
+    cl_device_id device;
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel flat;
+    cl_kernel hierarchical;
+    int flat_block;
+    cl_mem tiles;
+    cl_mem masses;
+    cl_mem levels;
+    cl_mem forces;
+    cl_event written[2];
+    cl_event done;
+};
+
+typedef struct px_helper_s px_helper;
+
+px_helper px_helpers[PX_MAX_HELPERS];
+int px_helper_count;
+int px_split[PX_MAX_HELPERS + 2];
+bool px_multi_device;
+px_kernel px_last_kernel;          // of the last PX_step, for PX_download
+
+void PX_release_helper(px_helper *h){
+    PX_release_events(h->written, 2);
+    PX_release_events(&h->done, 1);
+    cl_mem buffers[4] = {h->tiles, h->masses, h->levels, h->forces};
+    for (int b = 0; b < 4; b++) {
+        if (buffers[b] != NULL)
+            clReleaseMemObject(buffers[b]);
+    }
+    if (h->flat != NULL)
+        clReleaseKernel(h->flat);
+    if (h->hierarchical != NULL)
+        clReleaseKernel(h->hierarchical);
+    if (h->program != NULL)
+        clReleaseProgram(h->program);
+    if (h->queue != NULL)
+        clReleaseCommandQueue(h->queue);
+    if (h->context != NULL)
+        clReleaseContext(h->context);
+    memset(h, 0, sizeof(*h));
+}
+
+// Sets up h for the current grid, returns non-zero if the device cannot
+// take part.
+int PX_setup_helper(px_helper *h, const cl_int4 *levels, int level_count, int tile_count,
+        int fine_count, const cl_float2 *positions, const cl_float *masses){
+    cl_int e1, e2, e3, e4;
+    clGetDeviceInfo(h->device, CL_DEVICE_NAME, sizeof(h->name) - 1, h->name, NULL);
+    h->context = clCreateContext(NULL, 1, &h->device, NULL, NULL, &e1);
+    if (e1 != CL_SUCCESS)
+        return 1;
+    h->queue = clCreateCommandQueueWithProperties(h->context, h->device, NULL, &e1);
+    if (e1 != CL_SUCCESS)
+        return 1;
+    h->program = PX_build_program_on(h->context, h->device, px_options);
+    if (h->program == NULL)
+        return 1;
+    h->flat = clCreateKernel(h->program, "calculate_force", &e1);
+    h->hierarchical = clCreateKernel(h->program, "calculate_force_hierarchical", &e2);
+    if (e1 != CL_SUCCESS || e2 != CL_SUCCESS)
+        return 1;
+
+    size_t max_group;
+    clGetKernelWorkGroupInfo(h->flat, h->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_group),
+            &max_group, NULL);
+    h->flat_block = PX_FLAT_BLOCK;
+    while (h->flat_block > max_group) {
+        h->flat_block /= 2;
+    }
+
+    h->tiles = clCreateBuffer(h->context, CL_MEM_READ_ONLY, sizeof(cl_float2) * tile_count,
+            NULL, &e1);
+    h->masses = clCreateBuffer(h->context, CL_MEM_READ_ONLY, sizeof(cl_float) * tile_count,
+            NULL, &e2);
+    h->levels = clCreateBuffer(h->context, CL_MEM_READ_ONLY, sizeof(cl_int4) * level_count,
+            NULL, &e3);
+    h->forces = clCreateBuffer(h->context, CL_MEM_WRITE_ONLY, sizeof(cl_float2) * fine_count,
+            NULL, &e4);
+    if (e1 != CL_SUCCESS || e2 != CL_SUCCESS || e3 != CL_SUCCESS || e4 != CL_SUCCESS)
+        return 1;
+    e1 = clEnqueueWriteBuffer(h->queue, h->levels, CL_FALSE, 0, sizeof(cl_int4) * level_count,
+            levels, 0, NULL, NULL);
+    e2 = clEnqueueWriteBuffer(h->queue, h->tiles, CL_FALSE, 0, sizeof(cl_float2) * tile_count,
+            positions, 0, NULL, NULL);
+    e3 = clEnqueueWriteBuffer(h->queue, h->masses, CL_TRUE, 0, sizeof(cl_float) * tile_count,
+            masses, 0, NULL, NULL);
+    if (e1 != CL_SUCCESS || e2 != CL_SUCCESS || e3 != CL_SUCCESS)
+        return 1;
 
+    cl_int cols = levels[0].s[0];
+    cl_int rows = levels[0].s[1];
+    cl_int count = level_count;
+    cl_int e[12];
+    e[0] = clSetKernelArg(h->flat, 0, sizeof(cl_mem), (void*)&h->tiles);
+    e[1] = clSetKernelArg(h->flat, 1, sizeof(cl_mem), (void*)&h->masses);
+    e[2] = clSetKernelArg(h->flat, 2, sizeof(cl_int), (void*)&cols);
+    e[3] = clSetKernelArg(h->flat, 3, sizeof(cl_int), (void*)&rows);
+    e[4] = clSetKernelArg(h->flat, 4, sizeof(cl_mem), (void*)&h->forces);
+    e[5] = clSetKernelArg(h->flat, 5, sizeof(cl_float2) * h->flat_block, NULL);
+    e[6] = clSetKernelArg(h->flat, 6, sizeof(cl_float) * h->flat_block, NULL);
+    e[7] = clSetKernelArg(h->hierarchical, 0, sizeof(cl_mem), (void*)&h->tiles);
+    e[8] = clSetKernelArg(h->hierarchical, 1, sizeof(cl_mem), (void*)&h->masses);
+    e[9] = clSetKernelArg(h->hierarchical, 2, sizeof(cl_mem), (void*)&h->levels);
+    e[10] = clSetKernelArg(h->hierarchical, 3, sizeof(cl_int), (void*)&count);
+    e[11] = clSetKernelArg(h->hierarchical, 4, sizeof(cl_mem), (void*)&h->forces);
+    for (int i = 0; i < 12; i++) {
+        if (e[i] != CL_SUCCESS)
+            return 1;
+    }
     return 0;
 }
 
-int PX_set_gpu_kernel_args(int tile_h, int tile_v){
-    cl_int e1, e2, e3, e4, e5;
+// With px_multi_device set, starts every OpenCL device other than cldevice
+// on any platform as a helper. The split leaves all tiles to cldevice
+// until PX_balance measures the devices.
+void PX_init_helpers(const cl_int4 *levels, int level_count, int tile_count, int fine_count,
+        const cl_float2 *positions, const cl_float *masses){
+    px_split[0] = 0;
+    for (int d = 1; d < PX_MAX_HELPERS + 2; d++) {
+        px_split[d] = fine_count;
+    }
+    if (!px_multi_device)
+        return;
+    if (px_zero_copy) {
+        fprintf(stderr, "Zero-copy buffers are on, not splitting over several devices\n");
+        return;
+    }
+
+    cl_platform_id platforms[64];
+    cl_uint platformcount;
+    if (clGetPlatformIDs(64, platforms, &platformcount) != CL_SUCCESS)
+        return;
+    for (int p = 0; p < platformcount; p++) {
+        cl_device_id devices[64];
+        cl_uint devicecount;
+        if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 64, devices, &devicecount)
+                != CL_SUCCESS)
+            continue;
+        for (int d = 0; d < devicecount && px_helper_count < PX_MAX_HELPERS; d++) {
+            if (devices[d] == cldevice)
+                continue;
+            px_helper *h = &px_helpers[px_helper_count];
+            memset(h, 0, sizeof(*h));
+            h->device = devices[d];
+            if (PX_setup_helper(h, levels, level_count, tile_count, fine_count, positions,
+                        masses) != 0) {
+                fprintf(stderr, "Device %s cannot help, skipped\n", h->name);
+                PX_release_helper(h);
+                continue;
+            }
+            printf("Helper device: %s\n", h->name);
+            px_helper_count++;
+        }
+    }
+}
+
+void PX_clear_helpers(){
+    for (int i = 0; i < px_helper_count; i++) {
+        if (px_helpers[i].queue != NULL)
+            clFinish(px_helpers[i].queue);
+        PX_release_helper(&px_helpers[i]);
+    }
+    px_helper_count = 0;
+}
+
+// Whether the tile step of kernel is split over the helpers. The device
+// resident path keeps all forces on cldevice.
+bool PX_split_active(px_kernel kernel){
+    return px_helper_count > 0 && !px_device_ready && kernel != PX_KERNEL_SYMMETRIC;
+}
+
+cl_int PX_helper_launch(px_helper *h, px_kernel kernel, int begin, int end,
+        cl_uint wait_count, const cl_event *wait, cl_event *done){
+    if (kernel == PX_KERNEL_FLAT)
+        return PX_enqueue_range(h->queue, h->flat, h->flat_block, begin, end, wait_count, wait,
+                done);
+    return PX_enqueue_range(h->queue, h->hierarchical, 0, begin, end, wait_count, wait, done);
+}
+
+// tile_count covers every level of the tile hierarchy, levels is its
+// (cols, rows, offset) table with level 0 first. In zero-copy mode the
+// buffers are built on the host tile arrays, which should be page aligned,
+// and are handed to the host mapped. On failure nothing stays allocated and
+// the OpenCL error is returned, so the caller can pick another backend.
+cl_int PX_allocate_gpu_buffers(int tile_count, int level_count, cl_float2 *host_tiles,
+        cl_float *host_masses, cl_float2 *host_forces){
+    cl_int e1, e2, e3, e4;
+    // buffers are often only allocated on first use, where a failure is fatal
+    if (sizeof(cl_float2) * tile_count > px_max_alloc)
+        return CL_INVALID_BUFFER_SIZE;
+    // helpers read the host tiles, which the device owns while unmapped
+    px_zero_copy = px_zero_copy_request == PX_ZERO_COPY_ON
+        || (px_zero_copy_request == PX_ZERO_COPY_AUTO && px_unified_memory && !px_multi_device);
+    cl_mem_flags host = px_zero_copy ? CL_MEM_USE_HOST_PTR : 0;
+
+    // tiles and masses are written by the device binning as well
+    gpu_tiles = clCreateBuffer(clcontext, CL_MEM_READ_WRITE | host, sizeof(cl_float2) * tile_count,
+            px_zero_copy ? host_tiles : NULL, &e1);
+    gpu_masses = clCreateBuffer(clcontext, CL_MEM_READ_WRITE | host, sizeof(float) * tile_count,
+            px_zero_copy ? host_masses : NULL, &e2);
+    gpu_levels = clCreateBuffer(clcontext, CL_MEM_READ_ONLY, sizeof(cl_int4) * level_count, NULL, &e3);
+    gpu_out_forces = clCreateBuffer(clcontext, CL_MEM_READ_WRITE | host,
+            sizeof(cl_float2) * tile_count, px_zero_copy ? host_forces : NULL, &e4);
+
+    cl_int error = e1 != CL_SUCCESS ? e1 : e2 != CL_SUCCESS ? e2 : e3 != CL_SUCCESS ? e3 : e4;
+    if (error != CL_SUCCESS) {
+        cl_mem *buffers[] = {&gpu_tiles, &gpu_masses, &gpu_levels, &gpu_out_forces};
+        for (int b = 0; b < 4; b++) {
+            if (*buffers[b] != NULL)
+                clReleaseMemObject(*buffers[b]);
+            *buffers[b] = NULL;
+        }
+        return error;
+    }
+
+    px_tile_count = tile_count;
+    px_host_tiles = host_tiles;
+    px_host_masses = host_masses;
+    px_host_forces = host_forces;
+    if (px_zero_copy) {
+        printf("Zero-copy tile buffers\n");
+        PX_map_tiles(0, NULL);
+    }
+    return 0;
+}
+
+// clkernel may be rebuilt or change local size, so its arguments are set
+// separately from the rest.
+void PX_set_flat_args(){
+    cl_int e1, e2, e3, e4, e5, e6, e7;
+    cl_int cols = px_levels[0].s[0];
+    cl_int rows = px_levels[0].s[1];
     e1 = clSetKernelArg(clkernel, 0, sizeof(cl_mem), (void*)&gpu_tiles);
     e2 = clSetKernelArg(clkernel, 1, sizeof(cl_mem), (void*)&gpu_masses);
-    e3 = clSetKernelArg(clkernel, 2, sizeof(cl_mem), (void*)&tile_v);
-    e4 = clSetKernelArg(clkernel, 3, sizeof(cl_mem), (void*)&tile_h);
+    e3 = clSetKernelArg(clkernel, 2, sizeof(cl_int), (void*)&cols);
+    e4 = clSetKernelArg(clkernel, 3, sizeof(cl_int), (void*)&rows);
     e5 = clSetKernelArg(clkernel, 4, sizeof(cl_mem), (void*)&gpu_out_forces);
+    e6 = clSetKernelArg(clkernel, 5, sizeof(cl_float2) * px_flat_block, NULL);
+    e7 = clSetKernelArg(clkernel, 6, sizeof(cl_float) * px_flat_block, NULL);
+
+    ASSERT_NOERROR(e1);
+    ASSERT_NOERROR(e2);
+    ASSERT_NOERROR(e3);
+    ASSERT_NOERROR(e4);
+    ASSERT_NOERROR(e5);
+    ASSERT_NOERROR(e6);
+    ASSERT_NOERROR(e7);
+}
+
+int PX_set_gpu_kernel_args(cl_int4 *levels, int level_count){
+    cl_int e1, e2, e3, e4, e5;
+    e1 = clEnqueueWriteBuffer(clqueue, gpu_levels, CL_TRUE, 0,
+            sizeof(cl_int4) * level_count, levels, 0, NULL, NULL);
+    if (e1 != CL_SUCCESS)
+        return e1;
+    px_level_count = level_count;
+    memcpy(px_levels, levels, sizeof(cl_int4) * level_count);
+
+    PX_set_flat_args();
+
+    cl_int count = level_count;
+    e1 = clSetKernelArg(clkernel_hierarchical, 0, sizeof(cl_mem), (void*)&gpu_tiles);
+    e2 = clSetKernelArg(clkernel_hierarchical, 1, sizeof(cl_mem), (void*)&gpu_masses);
+    e3 = clSetKernelArg(clkernel_hierarchical, 2, sizeof(cl_mem), (void*)&gpu_levels);
+    e4 = clSetKernelArg(clkernel_hierarchical, 3, sizeof(cl_int), (void*)&count);
+    e5 = clSetKernelArg(clkernel_hierarchical, 4, sizeof(cl_mem), (void*)&gpu_out_forces);
 
     ASSERT_NOERROR(e1);
     ASSERT_NOERROR(e2);
@@ -158,14 +1048,100 @@ int PX_set_gpu_kernel_args(int tile_h, int tile_v){
 }
 
 void PX_clearCL(){
-    clReleaseMemObject(gpu_tiles);
-    clReleaseMemObject(gpu_masses);
-    clReleaseMemObject(gpu_out_forces);
+    if (px_tiles_mapped)
+        PX_unmap_tiles(NULL);
+    for (int b = 0; b < 2; b++) {
+        if (px_snapshot_mapped[b])
+            clEnqueueUnmapMemObject(clqueue_io, gpu_snapshot_x[b], px_snapshot_x[b], 0, NULL, NULL);
+        if (px_snapshot_mapped[b])
+            clEnqueueUnmapMemObject(clqueue_io, gpu_snapshot_y[b], px_snapshot_y[b], 0, NULL, NULL);
+    }
+    clFinish(clqueue);
+    clFinish(clqueue_io);
+    PX_clear_helpers();
+    PX_release_events(&px_symmetric_pass, 1);
+    PX_release_events(&px_compute_event, 1);
+    PX_release_events(px_upload_events, px_upload_event_count);
+    px_upload_event_count = 0;
+    PX_profile_reset();
+
+    // NULL when PB_opencl_init gave up on the allocation
+    if (gpu_tiles != NULL) {
+        clReleaseMemObject(gpu_tiles);
+        clReleaseMemObject(gpu_masses);
+        clReleaseMemObject(gpu_levels);
+        clReleaseMemObject(gpu_out_forces);
+    }
+    gpu_tiles = NULL;
+    gpu_masses = NULL;
+    gpu_levels = NULL;
+    gpu_out_forces = NULL;
+    if (gpu_partial_forces != NULL)
+        clReleaseMemObject(gpu_partial_forces);
+    gpu_partial_forces = NULL;
+    if (px_bucket_capacity > 0) {
+        clReleaseMemObject(gpu_bucket_x);
+        clReleaseMemObject(gpu_bucket_y);
+        clReleaseMemObject(gpu_bucket_tiles);
+        clReleaseMemObject(gpu_bucket_particles);
+    }
+    if (px_bucket_tile_capacity > 0) {
+        clReleaseMemObject(gpu_bucket_counts);
+        clReleaseMemObject(gpu_bucket_start);
+    }
+    px_bucket_capacity = 0;
+    px_bucket_tile_capacity = 0;
+    if (px_device_ready) {
+        clReleaseMemObject(gpu_px);
+        clReleaseMemObject(gpu_py);
+        clReleaseMemObject(gpu_pvx);
+        clReleaseMemObject(gpu_pvy);
+        clReleaseMemObject(gpu_pm);
+        clReleaseMemObject(gpu_pfx);
+        clReleaseMemObject(gpu_pfy);
+        clReleaseMemObject(gpu_moments);
+        for (int b = 0; b < 2; b++) {
+            PX_release_events(&px_snapshot_read[b], 1);
+            clReleaseMemObject(gpu_snapshot_x[b]);
+            clReleaseMemObject(gpu_snapshot_y[b]);
+            if (!px_zero_copy) {
+                free(px_snapshot_x[b]);
+                free(px_snapshot_y[b]);
+            }
+            px_snapshot_x[b] = NULL;
+            px_snapshot_y[b] = NULL;
+            px_snapshot_mapped[b] = false;
+        }
+        px_snapshot_frames = 0;
+        px_device_ready = false;
+    }
 
     //release memory before this
     clReleaseKernel( clkernel );
+    clReleaseKernel( clkernel_hierarchical );
+    clReleaseKernel( clkernel_symmetric );
+    clReleaseKernel( clkernel_reduce );
+    clReleaseKernel( clkernel_bucket_count );
+    clReleaseKernel( clkernel_bucket_scan );
+    clReleaseKernel( clkernel_bucket_scatter );
+    clReleaseKernel( clkernel_deposit );
+    clReleaseKernel( clkernel_finalize );
+    clReleaseKernel( clkernel_aggregate );
+    clReleaseKernel( clkernel_interpolate );
+    clReleaseKernel( clkernel_kick );
+    clReleaseKernel( clkernel_drift );
     clReleaseProgram( clprogram );
+    for (int v = 0; v < px_variant_count; v++) {
+        clReleaseProgram(px_variants[v].program);
+        px_variants[v].program = NULL;
+    }
+    px_variant_count = 0;
+    px_variant_next = 0;
+    px_options[0] = 0;
+    px_flat_unroll = 0;
+    px_hierarchical_group = 0;
     clReleaseCommandQueue( clqueue );
+    clReleaseCommandQueue( clqueue_io );
     clReleaseContext( clcontext );
     //    clReleaseDevice( cldevice );
 }
@@ -174,45 +1150,874 @@ void PX_clearCL(){
 
 int PX_flag = 0;
 
-void PX_calculate_physics(cl_float2 *positions, cl_float *masses, cl_float *output, int tile_h, int tile_v){
-    int size = tile_h * tile_v;
-    printf("rendering opencl frame\n");
-    cl_int e1, e2, e3, e4, e5;
-    e1 = clEnqueueWriteBuffer(clqueue, gpu_tiles, CL_TRUE, 0, 
-            sizeof(cl_float2) * size, positions, 0, NULL, NULL); 
-    e2 = clEnqueueWriteBuffer(clqueue, gpu_masses, CL_TRUE, 0, 
-            sizeof(float) * size, masses, 0, NULL, NULL); 
+// Whether the partial rows of a symmetric pass over count tiles in blocks
+// of block fit in one allocation.
+bool PX_symmetric_fits(int count, int block){
+    cl_ulong blocks = (count + block - 1) / block;
+    return blocks * count * sizeof(cl_float2) <= px_max_alloc;
+}
+
+// The symmetric kernel needs a partial row per block, on a large grid that
+// is more than the device can allocate and the flat kernel runs instead.
+px_kernel PX_usable_kernel(px_kernel kernel, int fine_count){
+    if (kernel != PX_KERNEL_SYMMETRIC || PX_symmetric_fits(fine_count, px_symmetric_block))
+        return kernel;
+    if (!px_symmetric_warned) {
+        fprintf(stderr, "Symmetric kernel does not fit in device memory for %d tiles, "
+                "using the flat kernel\n", fine_count);
+        px_symmetric_warned = true;
+    }
+    return PX_KERNEL_FLAT;
+}
+
+// Symmetric all-pairs pass over the first count tiles, the per block
+// partial rows are allocated on first use.
+cl_int PX_enqueue_symmetric(int count, cl_uint wait_count, const cl_event *wait,
+        cl_event *done){
+    int block = px_symmetric_block;
+    int block_count = (count + block - 1) / block;
+    cl_int e1, e2, e3, e4, e5, e6, e7;
+
+    if (!PX_symmetric_fits(count, block))
+        return CL_INVALID_BUFFER_SIZE;
+    if (gpu_partial_forces == NULL) {
+        gpu_partial_forces = clCreateBuffer(clcontext, CL_MEM_READ_WRITE,
+                sizeof(cl_float2) * block_count * count, NULL, &e1);
+        ASSERT_NOERROR(e1);
+    }
+
+    cl_int n = count;
+    cl_int blocks = block_count;
+    e1 = clSetKernelArg(clkernel_symmetric, 0, sizeof(cl_mem), (void*)&gpu_tiles);
+    e2 = clSetKernelArg(clkernel_symmetric, 1, sizeof(cl_mem), (void*)&gpu_masses);
+    e3 = clSetKernelArg(clkernel_symmetric, 2, sizeof(cl_int), (void*)&n);
+    e4 = clSetKernelArg(clkernel_symmetric, 3, sizeof(cl_mem), (void*)&gpu_partial_forces);
+    e5 = clSetKernelArg(clkernel_symmetric, 4, sizeof(cl_float2) * block, NULL);
+    e6 = clSetKernelArg(clkernel_symmetric, 5, sizeof(cl_float) * block, NULL);
+    e7 = clSetKernelArg(clkernel_symmetric, 6, sizeof(cl_float2) * block, NULL);
+
     ASSERT_NOERROR(e1);
     ASSERT_NOERROR(e2);
+    ASSERT_NOERROR(e3);
+    ASSERT_NOERROR(e4);
+    ASSERT_NOERROR(e5);
+    ASSERT_NOERROR(e6);
+    ASSERT_NOERROR(e7);
 
+    size_t globalWorkSize[2] = {block_count * block, block_count};
+    size_t localWorkSize[2] = {block, 1};
+    PX_release_events(&px_symmetric_pass, 1);
+    e1 = clEnqueueNDRangeKernel(clqueue, clkernel_symmetric, 2, NULL, globalWorkSize,
+            localWorkSize, wait_count, wait, px_profiling ? &px_symmetric_pass : NULL);
+    PRINT_ERROR(e1);
+    if (e1 != CL_SUCCESS)
+        return e1;
 
-    e1 = clSetKernelArg(clkernel, 0, sizeof(cl_mem), (void*)&gpu_tiles);
-    e2 = clSetKernelArg(clkernel, 1, sizeof(cl_mem), (void*)&gpu_masses);
-    e3 = clSetKernelArg(clkernel, 2, sizeof(cl_mem), (void*)&tile_v);
-    e4 = clSetKernelArg(clkernel, 3, sizeof(cl_mem), (void*)&tile_h);
-    e5 = clSetKernelArg(clkernel, 4, sizeof(cl_mem), (void*)&gpu_out_forces);
+    e1 = clSetKernelArg(clkernel_reduce, 0, sizeof(cl_mem), (void*)&gpu_partial_forces);
+    e2 = clSetKernelArg(clkernel_reduce, 1, sizeof(cl_int), (void*)&blocks);
+    e3 = clSetKernelArg(clkernel_reduce, 2, sizeof(cl_int), (void*)&n);
+    e4 = clSetKernelArg(clkernel_reduce, 3, sizeof(cl_mem), (void*)&gpu_out_forces);
 
     ASSERT_NOERROR(e1);
     ASSERT_NOERROR(e2);
     ASSERT_NOERROR(e3);
     ASSERT_NOERROR(e4);
 
+    size_t reduceSize = count;
+    e1 = clEnqueueNDRangeKernel(clqueue, clkernel_reduce, 1, NULL, &reduceSize,
+            NULL, 0, NULL, done);
+    PRINT_ERROR(e1);
+    return e1;
+}
 
+// positions and masses hold tile_count tiles over all levels. The writes
+// are not waited for, the caller must leave both arrays alone until
+// PX_download returns.
+void PX_upload(cl_float2 *positions, cl_float *masses, int tile_count){
+    cl_int e1, e2;
+    PX_release_events(px_upload_events, px_upload_event_count);
+    if (px_zero_copy) {
+        PX_unmap_tiles(px_upload_events);
+        px_upload_event_count = 3;
+        PX_profile_record(PX_STAT_WRITE_TILES, px_upload_events[0]);
+        PX_profile_record(PX_STAT_WRITE_MASSES, px_upload_events[1]);
+        clFlush(clqueue_io);
+        return;
+    }
+    e1 = clEnqueueWriteBuffer(clqueue_io, gpu_tiles, CL_FALSE, 0, 
+            sizeof(cl_float2) * tile_count, positions, 0, NULL, &px_upload_events[0]); 
+    e2 = clEnqueueWriteBuffer(clqueue_io, gpu_masses, CL_FALSE, 0, 
+            sizeof(float) * tile_count, masses, 0, NULL, &px_upload_events[1]); 
+    ASSERT_NOERROR(e1);
+    ASSERT_NOERROR(e2);
+    px_upload_event_count = 2;
+    PX_profile_record(PX_STAT_WRITE_TILES, px_upload_events[0]);
+    PX_profile_record(PX_STAT_WRITE_MASSES, px_upload_events[1]);
+    clFlush(clqueue_io);
 
-    size_t globalWorkSize = size;
-    size_t localWorkSize = 1;
+    // helpers whose slice is empty are idle, they need no tiles
+    for (int i = 0; i < px_helper_count && !px_device_ready; i++) {
+        px_helper *h = &px_helpers[i];
+        if (px_split[i + 1] == px_split[i + 2])
+            continue;
+        PX_release_events(h->written, 2);
+        e1 = clEnqueueWriteBuffer(h->queue, h->tiles, CL_FALSE, 0,
+                sizeof(cl_float2) * tile_count, positions, 0, NULL, &h->written[0]);
+        e2 = clEnqueueWriteBuffer(h->queue, h->masses, CL_FALSE, 0,
+                sizeof(float) * tile_count, masses, 0, NULL, &h->written[1]);
+        ASSERT_NOERROR(e1);
+        ASSERT_NOERROR(e2);
+        clFlush(h->queue);
+    }
+}
+
+// Enqueues kernel over the fine_count level 0 tiles with the current local
+// sizes.
+// The symmetric kernel always covers all of them, the others only tiles
+// begin to end. An empty range still completes done.
+cl_int PX_launch_range(px_kernel kernel, int begin, int end, int fine_count,
+        cl_uint wait_count, const cl_event *wait, cl_event *done){
+    if (kernel == PX_KERNEL_SYMMETRIC)
+        return PX_enqueue_symmetric(fine_count, wait_count, wait, done);
+    if (begin == end)
+        return clEnqueueMarkerWithWaitList(clqueue, wait_count, wait, done);
+    if (kernel == PX_KERNEL_FLAT)
+        return PX_enqueue_range(clqueue, clkernel, px_flat_block, begin, end, wait_count, wait,
+                done);
+    return PX_enqueue_range(clqueue, clkernel_hierarchical, px_hierarchical_group, begin, end,
+            wait_count, wait, done);
+}
 
-    e5 = clEnqueueNDRangeKernel(clqueue, clkernel, 1, NULL, &globalWorkSize,
-            &localWorkSize, 0 , NULL, NULL);
+cl_int PX_launch(px_kernel kernel, int fine_count, cl_uint wait_count, const cl_event *wait,
+        cl_event *done){
+    return PX_launch_range(kernel, 0, fine_count, fine_count, wait_count, wait, done);
+}
+
+// Forces are computed for the first fine_count tiles (level 0). The
+// hierarchical kernel reads the coarse levels, the flat and symmetric ones
+// sum every level 0 pair. Waits on the device for a pending PX_upload and
+// returns without waiting for the kernel.
+void PX_step(px_kernel kernel, int fine_count){
+    kernel = PX_usable_kernel(kernel, fine_count);
+    PX_release_events(&px_compute_event, 1);
+    px_last_kernel = kernel;
+    bool split = PX_split_active(kernel);
+    cl_int e5 = PX_launch_range(kernel, 0, split ? px_split[1] : fine_count, fine_count,
+            px_upload_event_count, px_upload_event_count > 0 ? px_upload_events : NULL,
+            &px_compute_event);
     PRINT_ERROR(e5);
+    for (int i = 0; split && i < px_helper_count; i++) {
+        px_helper *h = &px_helpers[i];
+        if (px_split[i + 1] == px_split[i + 2])
+            continue;
+        PX_release_events(&h->done, 1);
+        e5 = PX_helper_launch(h, kernel, px_split[i + 1], px_split[i + 2], 2, h->written,
+                &h->done);
+        PRINT_ERROR(e5);
+        PX_release_events(h->written, 2);
+        clFlush(h->queue);
+    }
+    if (kernel == PX_KERNEL_SYMMETRIC) {
+        PX_profile_record(PX_STAT_KERNEL, px_symmetric_pass);
+        PX_profile_record(PX_STAT_REDUCE, px_compute_event);
+    } else {
+        PX_profile_record(PX_STAT_KERNEL, px_compute_event);
+    }
+    PX_release_events(px_upload_events, px_upload_event_count);
+    px_upload_event_count = 0;
+    clFlush(clqueue);
+}
 
-    cl_int e6 = clEnqueueReadBuffer(clqueue, gpu_out_forces, CL_TRUE, 0, 
-            sizeof(cl_float2) * size, output, 0, NULL, NULL);
+const char *PX_kernel_name(px_kernel kernel){
+    switch (kernel) {
+        case PX_KERNEL_FLAT:
+            return "flat";
+        case PX_KERNEL_SYMMETRIC:
+            return "symmetric";
+        default:
+            return "hierarchical";
+    }
+}
 
-    //ASSERT_NOERROR(e6);
+double PX_now(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
 
-    cl_int e7 = clFinish(clqueue);
+// Installs the flat kernel of the current specialisation built with
+// FLAT_UNROLL set to unroll, 0 for none.
+int PX_use_flat_variant(int unroll){
+    char options[sizeof(px_options) + 32];
+    snprintf(options, sizeof(options), "%s", px_options);
+    if (unroll > 0) {
+        snprintf(options + strlen(options), sizeof(options) - strlen(options),
+                "%s-D FLAT_UNROLL=%d", options[0] != 0 ? " " : "", unroll);
+    }
+    cl_program program = PX_program_variant(options);
+    if (program == NULL || PX_replace_kernel(&clkernel, program, "calculate_force") != CL_SUCCESS)
+        return 1;
+    px_flat_unroll = unroll;
+    PX_set_flat_args();
+    return 0;
+}
 
-    //ASSERT_NOERROR(e7);
+// Sets the local size of kernel, 0 meaning the runtime's choice for the
+// hierarchical kernel.
+void PX_set_group(px_kernel kernel, int group){
+    if (kernel == PX_KERNEL_FLAT) {
+        px_flat_block = group;
+        PX_set_flat_args();
+    } else if (kernel == PX_KERNEL_SYMMETRIC) {
+        // the partial sums have one row per block
+        if (group != px_symmetric_block && gpu_partial_forces != NULL) {
+            clReleaseMemObject(gpu_partial_forces);
+            gpu_partial_forces = NULL;
+        }
+        px_symmetric_block = group;
+    } else {
+        px_hierarchical_group = group;
+    }
+}
+
+int PX_current_group(px_kernel kernel){
+    if (kernel == PX_KERNEL_FLAT)
+        return px_flat_block;
+    if (kernel == PX_KERNEL_SYMMETRIC)
+        return px_symmetric_block;
+    return px_hierarchical_group;
+}
 
+// Whether a local size can run kernel on this device at all.
+bool PX_group_fits(px_kernel kernel, int group, int fine_count){
+    cl_kernel k = kernel == PX_KERNEL_FLAT ? clkernel
+        : kernel == PX_KERNEL_SYMMETRIC ? clkernel_symmetric : clkernel_hierarchical;
+    size_t max_group;
+    cl_ulong local_mem;
+    clGetKernelWorkGroupInfo(k, cldevice, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_group),
+            &max_group, NULL);
+    clGetDeviceInfo(cldevice, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem), &local_mem, NULL);
+    if (group > max_group)
+        return false;
+    if (kernel == PX_KERNEL_FLAT)
+        return (cl_ulong)group * (sizeof(cl_float2) + sizeof(cl_float)) <= local_mem;
+    if (kernel == PX_KERNEL_SYMMETRIC) {
+        return (cl_ulong)group * (2 * sizeof(cl_float2) + sizeof(cl_float)) <= local_mem
+            && PX_symmetric_fits(fine_count, group);
+    }
+    return true;
+}
+
+// Seconds per launch after one untimed one, negative if the launch fails.
+double PX_time_launch(px_kernel kernel, int fine_count){
+    cl_event done = NULL;
+    clFinish(clqueue);
+    if (PX_launch(kernel, fine_count, 0, NULL, &done) != CL_SUCCESS) {
+        clFinish(clqueue);
+        return -1;
+    }
+    cl_int status = clWaitForEvents(1, &done);
+    clReleaseEvent(done);
+    if (status != CL_SUCCESS)
+        return -1;
+
+    double start = PX_now();
+    for (int i = 0; i < PX_TUNE_RUNS; i++) {
+        PX_launch(kernel, fine_count, 0, NULL, NULL);
+    }
+    clFinish(clqueue);
+    return (PX_now() - start) / PX_TUNE_RUNS;
+}
+
+// One tuning file per device, driver, kernel, grid shape and set of build
+// options, since a specialised program can favour a different local size.
+int PX_tuning_path(char *path, size_t size, px_kernel kernel, int fine_count){
+    char base[512];
+    if (PX_cache_dir(base, sizeof(base)) != 0)
+        return 1;
+    uint64_t options = PX_hash(0xcbf29ce484222325ull, px_options, strlen(px_options) + 1);
+    snprintf(path, size, "%s/tune-%016llx-%s-%dx%d-%d-%016llx.txt", base,
+            (unsigned long long)PX_device_hash(cldevice), PX_kernel_name(kernel),
+            px_levels[0].s[0], px_levels[0].s[1], fine_count, (unsigned long long)options);
+    return 0;
+}
+
+int PX_load_tuning(const char *path, px_kernel kernel, int fine_count){
+    FILE *fptr = fopen(path, "r");
+    if (fptr == NULL)
+        return 1;
+    int group, unroll;
+    int read = fscanf(fptr, "group %d unroll %d", &group, &unroll);
+    fclose(fptr);
+    if (read != 2 || group < 0 || unroll < 0)
+        return 1;
+    if (kernel == PX_KERNEL_FLAT && unroll != px_flat_unroll && PX_use_flat_variant(unroll) != 0)
+        return 1;
+    if (group == 0 ? kernel != PX_KERNEL_HIERARCHICAL : !PX_group_fits(kernel, group, fine_count))
+        return 1;
+    PX_set_group(kernel, group);
+    return 0;
+}
+
+void PX_save_tuning(const char *path, px_kernel kernel){
+    FILE *fptr = fopen(path, "w");
+    if (fptr == NULL)
+        return;
+    fprintf(fptr, "group %d\nunroll %d\n", PX_current_group(kernel),
+            kernel == PX_KERNEL_FLAT ? px_flat_unroll : 0);
+    fclose(fptr);
+}
+
+// Picks the local size, and for the flat kernel the unroll factor, that
+// runs kernel fastest on the current grid. The result is kept in a tuning
+// file and reused on later runs unless px_retune is set.
+void PX_tune(px_kernel kernel, int fine_count){
+    char path[600];
+    bool stored = PX_tuning_path(path, sizeof(path), kernel, fine_count) == 0;
+    if (stored && !px_retune && PX_load_tuning(path, kernel, fine_count) == 0) {
+        printf("Tuning for %s kernel loaded: local size %d, unroll %d\n", PX_kernel_name(kernel),
+                PX_current_group(kernel), px_flat_unroll);
+        return;
+    }
+
+    // kernels must not run on buffers the host has mapped
+    bool mapped = px_tiles_mapped;
+    if (mapped)
+        PX_unmap_tiles(NULL);
+
+    static const int groups[] = {0, 16, 32, 64, 128, 256, 512, 1024};
+    static const int unrolls[] = {0, 2, 4, 8};
+    int variants = kernel == PX_KERNEL_FLAT ? 4 : 1;
+    int best_group = PX_current_group(kernel);
+    int best_unroll = px_flat_unroll;
+    double best_time = -1;
+
+    for (int u = 0; u < variants; u++) {
+        if (kernel == PX_KERNEL_FLAT && PX_use_flat_variant(unrolls[u]) != 0)
+            continue;
+        for (int g = 0; g < sizeof(groups) / sizeof(groups[0]); g++) {
+            // only the hierarchical kernel can leave the size to the runtime
+            if (groups[g] == 0 && kernel != PX_KERNEL_HIERARCHICAL)
+                continue;
+            if (groups[g] > 0 && !PX_group_fits(kernel, groups[g], fine_count))
+                continue;
+            PX_set_group(kernel, groups[g]);
+            double t = PX_time_launch(kernel, fine_count);
+            if (t >= 0 && (best_time < 0 || t < best_time)) {
+                best_time = t;
+                best_group = groups[g];
+                best_unroll = unrolls[u];
+            }
+        }
+    }
+
+    if (kernel == PX_KERNEL_FLAT && best_unroll != px_flat_unroll)
+        PX_use_flat_variant(best_unroll);
+    PX_set_group(kernel, best_group);
+    if (mapped)
+        PX_map_tiles(0, NULL);
+
+    if (best_time < 0) {
+        fprintf(stderr, "Tuning the %s kernel failed, keeping the defaults\n",
+                PX_kernel_name(kernel));
+        return;
+    }
+    printf("Tuned %s kernel: local size %d, unroll %d, %.3f ms\n", PX_kernel_name(kernel),
+            best_group, kernel == PX_KERNEL_FLAT ? best_unroll : 0, best_time * 1e3);
+    if (stored)
+        PX_save_tuning(path, kernel);
+}
+
+// Seconds per launch of kernel over all fine_count tiles on device d, 0
+// being cldevice, negative if it fails.
+double PX_time_device(int d, px_kernel kernel, int fine_count){
+    cl_command_queue queue = d == 0 ? clqueue : px_helpers[d - 1].queue;
+    double start = 0;
+    for (int run = 0; run <= PX_TUNE_RUNS; run++) {
+        // the first run is not timed
+        if (run == 1)
+            start = PX_now();
+        cl_int e1 = d == 0 ? PX_launch(kernel, fine_count, 0, NULL, NULL)
+            : PX_helper_launch(&px_helpers[d - 1], kernel, 0, fine_count, 0, NULL, NULL);
+        if (e1 != CL_SUCCESS || clFinish(queue) != CL_SUCCESS)
+            return -1;
+    }
+    return (PX_now() - start) / PX_TUNE_RUNS;
+}
+
+// Splits the level 0 tiles over cldevice and the helpers in proportion to
+// how fast each runs kernel on the whole grid.
+void PX_balance(px_kernel kernel, int fine_count){
+    if (px_helper_count == 0 || kernel == PX_KERNEL_SYMMETRIC)
+        return;
+
+    int devices = px_helper_count + 1;
+    double speed[PX_MAX_HELPERS + 1];
+    double total = 0;
+    for (int d = 0; d < devices; d++) {
+        double t = PX_time_device(d, kernel, fine_count);
+        speed[d] = t > 0 ? 1 / t : 0;
+        total += speed[d];
+    }
+    // too few tiles for aligned slices, cldevice keeps the whole grid
+    if (total == 0 || fine_count < PX_SPLIT_ALIGN * devices)
+        return;
+
+    // slices round down to PX_SPLIT_ALIGN, the rest goes to the fastest
+    // device; a device that failed to time gets nothing
+    int count[PX_MAX_HELPERS + 1];
+    int fastest = 0;
+    int rest = fine_count;
+    for (int d = 0; d < devices; d++) {
+        count[d] = (int)(speed[d] / total * fine_count / PX_SPLIT_ALIGN) * PX_SPLIT_ALIGN;
+        rest -= count[d];
+        if (speed[d] > speed[fastest])
+            fastest = d;
+    }
+    count[fastest] += rest;
+
+    px_split[0] = 0;
+    for (int d = 0; d < devices; d++) {
+        px_split[d + 1] = px_split[d] + count[d];
+    }
+
+    for (int d = 0; d < devices; d++) {
+        char name[128] = {0};
+        if (d == 0) {
+            clGetDeviceInfo(cldevice, CL_DEVICE_NAME, sizeof(name) - 1, name, NULL);
+        } else {
+            snprintf(name, sizeof(name), "%s", px_helpers[d - 1].name);
+        }
+        printf("Split: %s takes %d of %d tiles\n", name, px_split[d + 1] - px_split[d],
+                fine_count);
+    }
+}
+
+// Reads the forces of the last PX_step once it is done, the only wait of
+// a host tile step.
+void PX_download(cl_float *output, int fine_count){
+    if (px_zero_copy) {
+        // output is the mapped force array itself
+        PX_map_tiles(1, &px_compute_event);
+        PX_profile_collect(false);
+        return;
+    }
+
+    // with a split every device reads back its own slice into output
+    bool split = PX_split_active(px_last_kernel);
+    int own = split ? px_split[1] : fine_count;
+    cl_event reads[PX_MAX_HELPERS + 1] = {NULL};
+    int read_count = 0;
+    if (own > 0) {
+        cl_int e6 = clEnqueueReadBuffer(clqueue_io, gpu_out_forces, CL_FALSE, 0,
+                sizeof(cl_float2) * own, output, 1, &px_compute_event, &reads[read_count++]);
+        ASSERT_NOERROR(e6);
+        clFlush(clqueue_io);
+    }
+    for (int i = 0; split && i < px_helper_count; i++) {
+        px_helper *h = &px_helpers[i];
+        int begin = px_split[i + 1];
+        int end = px_split[i + 2];
+        if (begin == end)
+            continue;
+        cl_int e6 = clEnqueueReadBuffer(h->queue, h->forces, CL_FALSE,
+                sizeof(cl_float2) * begin, sizeof(cl_float2) * (end - begin), output + 2 * begin,
+                1, &h->done, &reads[read_count++]);
+        ASSERT_NOERROR(e6);
+        clFlush(h->queue);
+    }
+
+    // the reads belong to different contexts, so wait on each one separately;
+    // a failed read would leave output half written
+    for (int i = 0; i < read_count; i++) {
+        cl_int e7 = clWaitForEvents(1, &reads[i]);
+        ASSERT_NOERROR(e7);
+    }
+    if (own > 0)
+        PX_profile_record(PX_STAT_READ_FORCES, reads[0]);
+    PX_release_events(reads, read_count);
+    PX_profile_collect(false);
+}
+
+void PX_reserve_buckets(int count, int tiles){
+    cl_int e1, e2, e3, e4;
+    if (count > px_bucket_capacity) {
+        if (px_bucket_capacity > 0) {
+            clReleaseMemObject(gpu_bucket_x);
+            clReleaseMemObject(gpu_bucket_y);
+            clReleaseMemObject(gpu_bucket_tiles);
+            clReleaseMemObject(gpu_bucket_particles);
+        }
+        gpu_bucket_x = clCreateBuffer(clcontext, CL_MEM_READ_ONLY, sizeof(float) * count, NULL, &e1);
+        gpu_bucket_y = clCreateBuffer(clcontext, CL_MEM_READ_ONLY, sizeof(float) * count, NULL, &e2);
+        gpu_bucket_tiles = clCreateBuffer(clcontext, CL_MEM_READ_WRITE, sizeof(cl_int) * count, NULL, &e3);
+        gpu_bucket_particles = clCreateBuffer(clcontext, CL_MEM_WRITE_ONLY, sizeof(cl_int) * count, NULL, &e4);
+        ASSERT_NOERROR(e1);
+        ASSERT_NOERROR(e2);
+        ASSERT_NOERROR(e3);
+        ASSERT_NOERROR(e4);
+        px_bucket_capacity = count;
+    }
+    if (tiles > px_bucket_tile_capacity) {
+        if (px_bucket_tile_capacity > 0) {
+            clReleaseMemObject(gpu_bucket_counts);
+            clReleaseMemObject(gpu_bucket_start);
+        }
+        gpu_bucket_counts = clCreateBuffer(clcontext, CL_MEM_READ_WRITE, sizeof(cl_int) * tiles, NULL, &e1);
+        gpu_bucket_start = clCreateBuffer(clcontext, CL_MEM_READ_WRITE, sizeof(cl_int) * (tiles + 1), NULL, &e2);
+        ASSERT_NOERROR(e1);
+        ASSERT_NOERROR(e2);
+        px_bucket_tile_capacity = tiles;
+    }
+}
+
+// Device side counterpart of TG_bucket: sorts the count particles at (x, y)
+// into a cols x rows grid and reads back the same start / particles index.
+void PX_bucket_particles(const float *x, const float *y, int count, int cols, int rows,
+        int *out_start, int *out_particles){
+    int tiles = cols * rows;
+    cl_int e1, e2, e3, e4, e5, e6, e7;
+    PX_reserve_buckets(count, tiles);
+
+    cl_int zero = 0;
+    e1 = clEnqueueWriteBuffer(clqueue, gpu_bucket_x, CL_FALSE, 0, sizeof(float) * count, x,
+            0, NULL, NULL);
+    e2 = clEnqueueWriteBuffer(clqueue, gpu_bucket_y, CL_FALSE, 0, sizeof(float) * count, y,
+            0, NULL, NULL);
+    e3 = clEnqueueFillBuffer(clqueue, gpu_bucket_counts, &zero, sizeof(zero), 0,
+            sizeof(cl_int) * tiles, 0, NULL, NULL);
+    ASSERT_NOERROR(e1);
+    ASSERT_NOERROR(e2);
+    ASSERT_NOERROR(e3);
+
+    cl_int n = count;
+    cl_int c = cols;
+    cl_int r = rows;
+    e1 = clSetKernelArg(clkernel_bucket_count, 0, sizeof(cl_mem), (void*)&gpu_bucket_x);
+    e2 = clSetKernelArg(clkernel_bucket_count, 1, sizeof(cl_mem), (void*)&gpu_bucket_y);
+    e3 = clSetKernelArg(clkernel_bucket_count, 2, sizeof(cl_int), (void*)&n);
+    e4 = clSetKernelArg(clkernel_bucket_count, 3, sizeof(cl_int), (void*)&c);
+    e5 = clSetKernelArg(clkernel_bucket_count, 4, sizeof(cl_int), (void*)&r);
+    e6 = clSetKernelArg(clkernel_bucket_count, 5, sizeof(cl_mem), (void*)&gpu_bucket_tiles);
+    e7 = clSetKernelArg(clkernel_bucket_count, 6, sizeof(cl_mem), (void*)&gpu_bucket_counts);
+    ASSERT_NOERROR(e1);
+    ASSERT_NOERROR(e2);
+    ASSERT_NOERROR(e3);
+    ASSERT_NOERROR(e4);
+    ASSERT_NOERROR(e5);
+    ASSERT_NOERROR(e6);
+    ASSERT_NOERROR(e7);
+
+    size_t particleSize = count;
+    e1 = clEnqueueNDRangeKernel(clqueue, clkernel_bucket_count, 1, NULL, &particleSize,
+            NULL, 0, NULL, NULL);
+    PRINT_ERROR(e1);
+
+    cl_int t = tiles;
+    e1 = clSetKernelArg(clkernel_bucket_scan, 0, sizeof(cl_mem), (void*)&gpu_bucket_counts);
+    e2 = clSetKernelArg(clkernel_bucket_scan, 1, sizeof(cl_int), (void*)&t);
+    e3 = clSetKernelArg(clkernel_bucket_scan, 2, sizeof(cl_mem), (void*)&gpu_bucket_start);
+    e4 = clSetKernelArg(clkernel_bucket_scan, 3, sizeof(cl_int) * px_scan_group, NULL);
+    ASSERT_NOERROR(e1);
+    ASSERT_NOERROR(e2);
+    ASSERT_NOERROR(e3);
+    ASSERT_NOERROR(e4);
+
+    size_t scanSize = px_scan_group;
+    e1 = clEnqueueNDRangeKernel(clqueue, clkernel_bucket_scan, 1, NULL, &scanSize,
+            &scanSize, 0, NULL, NULL);
+    PRINT_ERROR(e1);
+
+    // the counts are spent, reuse them as the write cursors
+    e1 = clEnqueueCopyBuffer(clqueue, gpu_bucket_start, gpu_bucket_counts, 0, 0,
+            sizeof(cl_int) * tiles, 0, NULL, NULL);
+    PRINT_ERROR(e1);
+
+    e1 = clSetKernelArg(clkernel_bucket_scatter, 0, sizeof(cl_mem), (void*)&gpu_bucket_tiles);
+    e2 = clSetKernelArg(clkernel_bucket_scatter, 1, sizeof(cl_int), (void*)&n);
+    e3 = clSetKernelArg(clkernel_bucket_scatter, 2, sizeof(cl_mem), (void*)&gpu_bucket_counts);
+    e4 = clSetKernelArg(clkernel_bucket_scatter, 3, sizeof(cl_mem), (void*)&gpu_bucket_particles);
+    ASSERT_NOERROR(e1);
+    ASSERT_NOERROR(e2);
+    ASSERT_NOERROR(e3);
+    ASSERT_NOERROR(e4);
+
+    e1 = clEnqueueNDRangeKernel(clqueue, clkernel_bucket_scatter, 1, NULL, &particleSize,
+            NULL, 0, NULL, NULL);
+    PRINT_ERROR(e1);
+
+    e1 = clEnqueueReadBuffer(clqueue, gpu_bucket_start, CL_FALSE, 0,
+            sizeof(cl_int) * (tiles + 1), out_start, 0, NULL, NULL);
+    e2 = clEnqueueReadBuffer(clqueue, gpu_bucket_particles, CL_TRUE, 0,
+            sizeof(cl_int) * count, out_particles, 0, NULL, NULL);
+    PRINT_ERROR(e1);
+    PRINT_ERROR(e2);
+}
+
+cl_mem PX_particle_buffer(const float *data, int count){
+    cl_int e1;
+    cl_mem buffer = clCreateBuffer(clcontext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+            sizeof(float) * count, (void*)data, &e1);
+    ASSERT_NOERROR(e1);
+    return buffer;
+}
+
+// Moves the particles onto the device for PX_device_forces, PX_device_kick
+// and PX_device_drift, after which the host copies are stale until
+// PX_device_positions. scheme is the mass_assignment used for both binning
+// and interpolation. Needs PX_set_gpu_kernel_args first.
+void PX_device_init(const float *x, const float *y, const float *vx, const float *vy,
+        const float *m, const float *fx, const float *fy, int count, int scheme){
+    cl_int e1, e2, e3, e4, e5, e6, e7, e8, e9;
+    gpu_px = PX_particle_buffer(x, count);
+    gpu_py = PX_particle_buffer(y, count);
+    gpu_pvx = PX_particle_buffer(vx, count);
+    gpu_pvy = PX_particle_buffer(vy, count);
+    gpu_pm = PX_particle_buffer(m, count);
+    gpu_pfx = PX_particle_buffer(fx, count);
+    gpu_pfy = PX_particle_buffer(fy, count);
+    gpu_moments = clCreateBuffer(clcontext, CL_MEM_READ_WRITE,
+            sizeof(cl_float2) * px_levels[0].s[0] * px_levels[0].s[1], NULL, &e1);
+    ASSERT_NOERROR(e1);
+    px_particle_count = count;
+    px_device_ready = true;
+
+    // the tiles never come back to the host in this mode
+    if (px_tiles_mapped)
+        PX_unmap_tiles(NULL);
+
+    // zero-copy snapshots are mapped in place instead of read into copies
+    cl_mem_flags host = px_zero_copy ? CL_MEM_ALLOC_HOST_PTR : 0;
+    for (int b = 0; b < 2; b++) {
+        gpu_snapshot_x[b] = clCreateBuffer(clcontext, CL_MEM_READ_WRITE | host,
+                sizeof(float) * count, NULL, &e1);
+        gpu_snapshot_y[b] = clCreateBuffer(clcontext, CL_MEM_READ_WRITE | host,
+                sizeof(float) * count, NULL, &e2);
+        ASSERT_NOERROR(e1);
+        ASSERT_NOERROR(e2);
+        px_snapshot_x[b] = px_zero_copy ? NULL : malloc(sizeof(float) * count);
+        px_snapshot_y[b] = px_zero_copy ? NULL : malloc(sizeof(float) * count);
+        px_snapshot_read[b] = NULL;
+        px_snapshot_mapped[b] = false;
+    }
+    px_snapshot_frames = 0;
+
+    cl_int n = count;
+    cl_int cols = px_levels[0].s[0];
+    cl_int rows = px_levels[0].s[1];
+    cl_int assignment = scheme;
+
+    e1 = clSetKernelArg(clkernel_deposit, 0, sizeof(cl_mem), (void*)&gpu_px);
+    e2 = clSetKernelArg(clkernel_deposit, 1, sizeof(cl_mem), (void*)&gpu_py);
+    e3 = clSetKernelArg(clkernel_deposit, 2, sizeof(cl_mem), (void*)&gpu_pm);
+    e4 = clSetKernelArg(clkernel_deposit, 3, sizeof(cl_int), (void*)&n);
+    e5 = clSetKernelArg(clkernel_deposit, 4, sizeof(cl_int), (void*)&cols);
+    e6 = clSetKernelArg(clkernel_deposit, 5, sizeof(cl_int), (void*)&rows);
+    e7 = clSetKernelArg(clkernel_deposit, 6, sizeof(cl_int), (void*)&assignment);
+    e8 = clSetKernelArg(clkernel_deposit, 7, sizeof(cl_mem), (void*)&gpu_masses);
+    e9 = clSetKernelArg(clkernel_deposit, 8, sizeof(cl_mem), (void*)&gpu_moments);
+    ASSERT_NOERROR(e1);
+    ASSERT_NOERROR(e2);
+    ASSERT_NOERROR(e3);
+    ASSERT_NOERROR(e4);
+    ASSERT_NOERROR(e5);
+    ASSERT_NOERROR(e6);
+    ASSERT_NOERROR(e7);
+    ASSERT_NOERROR(e8);
+    ASSERT_NOERROR(e9);
+
+    e1 = clSetKernelArg(clkernel_finalize, 0, sizeof(cl_mem), (void*)&gpu_masses);
+    e2 = clSetKernelArg(clkernel_finalize, 1, sizeof(cl_mem), (void*)&gpu_moments);
+    e3 = clSetKernelArg(clkernel_finalize, 2, sizeof(cl_int), (void*)&cols);
+    e4 = clSetKernelArg(clkernel_finalize, 3, sizeof(cl_int), (void*)&rows);
+    e5 = clSetKernelArg(clkernel_finalize, 4, sizeof(cl_mem), (void*)&gpu_tiles);
+    ASSERT_NOERROR(e1);
+    ASSERT_NOERROR(e2);
+    ASSERT_NOERROR(e3);
+    ASSERT_NOERROR(e4);
+    ASSERT_NOERROR(e5);
+
+    e1 = clSetKernelArg(clkernel_aggregate, 0, sizeof(cl_mem), (void*)&gpu_tiles);
+    e2 = clSetKernelArg(clkernel_aggregate, 1, sizeof(cl_mem), (void*)&gpu_masses);
+    e3 = clSetKernelArg(clkernel_aggregate, 2, sizeof(cl_mem), (void*)&gpu_levels);
+    ASSERT_NOERROR(e1);
+    ASSERT_NOERROR(e2);
+    ASSERT_NOERROR(e3);
+
+    e1 = clSetKernelArg(clkernel_interpolate, 0, sizeof(cl_mem), (void*)&gpu_px);
+    e2 = clSetKernelArg(clkernel_interpolate, 1, sizeof(cl_mem), (void*)&gpu_py);
+    e3 = clSetKernelArg(clkernel_interpolate, 2, sizeof(cl_int), (void*)&n);
+    e4 = clSetKernelArg(clkernel_interpolate, 3, sizeof(cl_int), (void*)&cols);
+    e5 = clSetKernelArg(clkernel_interpolate, 4, sizeof(cl_int), (void*)&rows);
+    e6 = clSetKernelArg(clkernel_interpolate, 5, sizeof(cl_int), (void*)&assignment);
+    e7 = clSetKernelArg(clkernel_interpolate, 6, sizeof(cl_mem), (void*)&gpu_out_forces);
+    e8 = clSetKernelArg(clkernel_interpolate, 7, sizeof(cl_mem), (void*)&gpu_pfx);
+    e9 = clSetKernelArg(clkernel_interpolate, 8, sizeof(cl_mem), (void*)&gpu_pfy);
+    ASSERT_NOERROR(e1);
+    ASSERT_NOERROR(e2);
+    ASSERT_NOERROR(e3);
+    ASSERT_NOERROR(e4);
+    ASSERT_NOERROR(e5);
+    ASSERT_NOERROR(e6);
+    ASSERT_NOERROR(e7);
+    ASSERT_NOERROR(e8);
+    ASSERT_NOERROR(e9);
+
+    e1 = clSetKernelArg(clkernel_kick, 0, sizeof(cl_mem), (void*)&gpu_pvx);
+    e2 = clSetKernelArg(clkernel_kick, 1, sizeof(cl_mem), (void*)&gpu_pvy);
+    e3 = clSetKernelArg(clkernel_kick, 2, sizeof(cl_mem), (void*)&gpu_pfx);
+    e4 = clSetKernelArg(clkernel_kick, 3, sizeof(cl_mem), (void*)&gpu_pfy);
+    e5 = clSetKernelArg(clkernel_kick, 4, sizeof(cl_mem), (void*)&gpu_pm);
+    e6 = clSetKernelArg(clkernel_kick, 5, sizeof(cl_int), (void*)&n);
+    ASSERT_NOERROR(e1);
+    ASSERT_NOERROR(e2);
+    ASSERT_NOERROR(e3);
+    ASSERT_NOERROR(e4);
+    ASSERT_NOERROR(e5);
+    ASSERT_NOERROR(e6);
+
+    e1 = clSetKernelArg(clkernel_drift, 0, sizeof(cl_mem), (void*)&gpu_px);
+    e2 = clSetKernelArg(clkernel_drift, 1, sizeof(cl_mem), (void*)&gpu_py);
+    e3 = clSetKernelArg(clkernel_drift, 2, sizeof(cl_mem), (void*)&gpu_pvx);
+    e4 = clSetKernelArg(clkernel_drift, 3, sizeof(cl_mem), (void*)&gpu_pvy);
+    e5 = clSetKernelArg(clkernel_drift, 4, sizeof(cl_int), (void*)&n);
+    ASSERT_NOERROR(e1);
+    ASSERT_NOERROR(e2);
+    ASSERT_NOERROR(e3);
+    ASSERT_NOERROR(e4);
+    ASSERT_NOERROR(e5);
+}
+
+void PX_enqueue_particles(cl_kernel kernel){
+    size_t globalWorkSize = px_particle_count;
+    cl_int e1 = clEnqueueNDRangeKernel(clqueue, kernel, 1, NULL, &globalWorkSize, NULL,
+            0, NULL, NULL);
+    PRINT_ERROR(e1);
+}
+
+// Bins the particles into level 0, builds the coarse levels, runs the tile
+// kernel and interpolates the tile forces back into the particles. Nothing
+// crosses the bus.
+void PX_device_forces(px_kernel kernel){
+    cl_int e1, e2;
+    int fine = px_levels[0].s[0] * px_levels[0].s[1];
+    cl_float zero = 0;
+    e1 = clEnqueueFillBuffer(clqueue, gpu_masses, &zero, sizeof(zero), 0,
+            sizeof(cl_float) * fine, 0, NULL, NULL);
+    e2 = clEnqueueFillBuffer(clqueue, gpu_moments, &zero, sizeof(zero), 0,
+            sizeof(cl_float2) * fine, 0, NULL, NULL);
+    PRINT_ERROR(e1);
+    PRINT_ERROR(e2);
+
+    PX_enqueue_particles(clkernel_deposit);
+
+    size_t fineSize = fine;
+    e1 = clEnqueueNDRangeKernel(clqueue, clkernel_finalize, 1, NULL, &fineSize, NULL,
+            0, NULL, NULL);
+    PRINT_ERROR(e1);
+
+    for (cl_int l = 1; l < px_level_count; l++) {
+        size_t levelSize = px_levels[l].s[0] * px_levels[l].s[1];
+        e1 = clSetKernelArg(clkernel_aggregate, 3, sizeof(cl_int), (void*)&l);
+        ASSERT_NOERROR(e1);
+        e1 = clEnqueueNDRangeKernel(clqueue, clkernel_aggregate, 1, NULL, &levelSize, NULL,
+                0, NULL, NULL);
+        PRINT_ERROR(e1);
+    }
+
+    PX_step(kernel, fine);
+    PX_enqueue_particles(clkernel_interpolate);
+}
+
+void PX_device_kick(float h){
+    cl_float step = h;
+    cl_int e1 = clSetKernelArg(clkernel_kick, 6, sizeof(cl_float), (void*)&step);
+    ASSERT_NOERROR(e1);
+    PX_enqueue_particles(clkernel_kick);
+}
+
+void PX_device_drift(float h){
+    cl_float step = h;
+    cl_int e1 = clSetKernelArg(clkernel_drift, 5, sizeof(cl_float), (void*)&step);
+    ASSERT_NOERROR(e1);
+    PX_enqueue_particles(clkernel_drift);
+}
+
+// Copies the positions after every step enqueued so far into the next
+// snapshot on the device and starts reading it back on the transfer queue,
+// so the kernels of the following steps can run meanwhile.
+void PX_device_snapshot(){
+    int slot = px_snapshot_frames % 2;
+    cl_int e1, e2, e3, e4;
+    cl_event copied[2];
+
+    if (px_snapshot_read[slot] != NULL) {
+        clWaitForEvents(1, &px_snapshot_read[slot]);
+        PX_release_events(&px_snapshot_read[slot], 1);
+    }
+
+    // a mapped snapshot has been drawn and goes back to the device
+    cl_uint unmapped_count = 0;
+    cl_event unmapped[2];
+    if (px_snapshot_mapped[slot]) {
+        clEnqueueUnmapMemObject(clqueue_io, gpu_snapshot_x[slot], px_snapshot_x[slot], 0, NULL,
+                &unmapped[0]);
+        clEnqueueUnmapMemObject(clqueue_io, gpu_snapshot_y[slot], px_snapshot_y[slot], 0, NULL,
+                &unmapped[1]);
+        clFlush(clqueue_io);
+        unmapped_count = 2;
+        px_snapshot_mapped[slot] = false;
+    }
+
+    size_t size = sizeof(float) * px_particle_count;
+    e1 = clEnqueueCopyBuffer(clqueue, gpu_px, gpu_snapshot_x[slot], 0, 0, size,
+            unmapped_count, unmapped_count > 0 ? unmapped : NULL, &copied[0]);
+    e2 = clEnqueueCopyBuffer(clqueue, gpu_py, gpu_snapshot_y[slot], 0, 0, size,
+            unmapped_count, unmapped_count > 0 ? unmapped : NULL, &copied[1]);
+    PRINT_ERROR(e1);
+    PRINT_ERROR(e2);
+    PX_release_events(unmapped, unmapped_count);
+    clFlush(clqueue);
+
+    if (px_zero_copy) {
+        px_snapshot_x[slot] = clEnqueueMapBuffer(clqueue_io, gpu_snapshot_x[slot], CL_FALSE,
+                CL_MAP_READ, 0, size, 1, &copied[0], NULL, &e3);
+        px_snapshot_y[slot] = clEnqueueMapBuffer(clqueue_io, gpu_snapshot_y[slot], CL_FALSE,
+                CL_MAP_READ, 0, size, 1, &copied[1], &px_snapshot_read[slot], &e4);
+        PRINT_ERROR(e3);
+        PRINT_ERROR(e4);
+        clFlush(clqueue_io);
+        px_snapshot_mapped[slot] = true;
+        PX_release_events(copied, 2);
+        px_snapshot_frames++;
+        return;
+    }
+
+    cl_event read_x;
+    e3 = clEnqueueReadBuffer(clqueue_io, gpu_snapshot_x[slot], CL_FALSE, 0, size,
+            px_snapshot_x[slot], 1, &copied[0], &read_x);
+    e4 = clEnqueueReadBuffer(clqueue_io, gpu_snapshot_y[slot], CL_FALSE, 0, size,
+            px_snapshot_y[slot], 1, &copied[1], &px_snapshot_read[slot]);
+    PRINT_ERROR(e3);
+    PRINT_ERROR(e4);
+    clFlush(clqueue_io);
+
+    // the io queue is in order, so the y read finishing covers the x one
+    clReleaseEvent(read_x);
+    PX_release_events(copied, 2);
+    px_snapshot_frames++;
+}
+
+// Positions of the snapshot before the latest one, so drawing a frame
+// overlaps with the steps of the next. Right after the first snapshot it
+// is that one. Blocks only if the read back is still running.
+void PX_device_positions(const float **x, const float **y){
+    int slot = px_snapshot_frames >= 2 ? (px_snapshot_frames - 2) % 2 : 0;
+    if (px_snapshot_read[slot] != NULL) {
+        cl_int e1 = clWaitForEvents(1, &px_snapshot_read[slot]);
+        PRINT_ERROR(e1);
+        PX_release_events(&px_snapshot_read[slot], 1);
+    }
+    *x = px_snapshot_x[slot];
+    *y = px_snapshot_y[slot];
 }
@@ -0,0 +1,134 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// P3M: the particle mesh handles the long range part of the force and the
+// short range rest is summed exactly over particles in the neighbouring cells
+// of a chaining mesh whose cells are at least one cutoff radius wide.
+
+#define P3M_SPLIT_CELLS 1.25f   // split radius in mesh cells
+#define P3M_CUTOFF_SPLITS 4.5f  // short range cutoff in split radii
+#define P3M_TABLE_SIZE 1024
+
+float p3m_split;
+float p3m_cutoff;
+int p3m_cells;                  // chaining mesh is p3m_cells x p3m_cells
+float p3m_cell_size;
+
+int *p3m_head;                  // first particle of each cell, -1 if empty
+int *p3m_next;                  // next particle in the same cell
+int p3m_capacity;
+
+// fraction of the full force that is short range, sampled over [0, cutoff]
+float p3m_table[P3M_TABLE_SIZE + 1];
+
+int P3M_init(int mesh_size){
+    if (PM_init(mesh_size, P3M_SPLIT_CELLS / mesh_size) != 0)
+        return 1;
+
+    p3m_split = pm_split;
+    p3m_cutoff = P3M_CUTOFF_SPLITS * p3m_split;
+    p3m_cells = fmax((int)(1.0f / p3m_cutoff), 1);
+    p3m_cell_size = 1.0f / p3m_cells;
+    p3m_head = malloc(sizeof(int) * p3m_cells * p3m_cells);
+    if (p3m_head == NULL) {
+        fprintf(stderr, "P3M: out of memory\n");
+        return 1;
+    }
+
+    for (int i = 0; i <= P3M_TABLE_SIZE; i++) {
+        float u = (p3m_cutoff * i / P3M_TABLE_SIZE) / (2 * p3m_split);
+        p3m_table[i] = erfcf(u) + 2 * u / sqrtf(M_PI) * expf(-u * u);
+    }
+    return 0;
+}
+
+vectori P3M_find_cell(float x, float y){
+    vectori coordinates;
+    coordinates.x = fmin(fmax((int)(x / p3m_cell_size), 0), p3m_cells - 1);
+    coordinates.y = fmin(fmax((int)(y / p3m_cell_size), 0), p3m_cells - 1);
+    return coordinates;
+}
+
+void P3M_build_cells(const particle_store *s){
+    if (s->count > p3m_capacity) {
+        p3m_capacity = s->count;
+        p3m_next = realloc(p3m_next, sizeof(int) * p3m_capacity);
+        if (p3m_next == NULL) {
+            fprintf(stderr, "P3M: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < p3m_cells * p3m_cells; i++) {
+        p3m_head[i] = -1;
+    }
+    for (int i = s->count - 1; i >= 0; i--) {
+        vectori cell = P3M_find_cell(s->x[i], s->y[i]);
+        int c = cell.y * p3m_cells + cell.x;
+        p3m_next[i] = p3m_head[c];
+        p3m_head[c] = i;
+    }
+}
+
+// Short range part of calculate_force_cpu, the complement of the mesh force.
+// Returns the force per unit of displacement, so the caller multiplies by dx
+// and dy.
+float P3M_short_range_factor(float dist2, float mass){
+    if (dist2 >= p3m_cutoff * p3m_cutoff || dist2 < FORCE_MIN_DIST * FORCE_MIN_DIST)
+        return 0;
+
+    float dist = sqrtf(dist2);
+    float t = dist / p3m_cutoff * P3M_TABLE_SIZE;
+    int k = (int)t;
+    float fraction = p3m_table[k] + (t - k) * (p3m_table[k + 1] - p3m_table[k]);
+    return FORCE_K * mass * fraction / (dist2 * dist);
+}
+
+// Short range pass over particles begin to end of the store in ctx. The
+// cells are only read, every particle writes its own force.
+void P3M_short_range(int begin, int end, int thread, void *ctx){
+    particle_store *s = ctx;
+    for (int i = begin; i < end; i++) {
+        float x = s->x[i];
+        float y = s->y[i];
+        vectori cell = P3M_find_cell(x, y);
+        int row_min = fmax(cell.y - 1, 0);
+        int row_max = fmin(cell.y + 1, p3m_cells - 1);
+        int col_min = fmax(cell.x - 1, 0);
+        int col_max = fmin(cell.x + 1, p3m_cells - 1);
+        float fx = 0;
+        float fy = 0;
+
+        for (int row = row_min; row <= row_max; row++) {
+            for (int col = col_min; col <= col_max; col++) {
+                for (int j = p3m_head[row * p3m_cells + col]; j != -1; j = p3m_next[j]) {
+                    if (j == i)
+                        continue;
+                    float dx = s->x[j] - x;
+                    float dy = s->y[j] - y;
+                    float f = P3M_short_range_factor(dx * dx + dy * dy, s->m[j]);
+                    fx += f * dx;
+                    fy += f * dy;
+                }
+            }
+        }
+        s->fx[i] += fx;
+        s->fy[i] += fy;
+    }
+}
+
+void P3M_calculate_forces(particle_store *s, mass_assignment scheme){
+    PM_calculate_forces(s, scheme);
+    P3M_build_cells(s);
+
+    parallel_for(s->count, P3M_short_range, s);
+}
+
+void P3M_clear(){
+    free(p3m_head);
+    free(p3m_next);
+    p3m_head = NULL;
+    p3m_next = NULL;
+    p3m_capacity = 0;
+}
@@ -0,0 +1,138 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Splits [0, count) into one contiguous chunk per thread and runs fn on each.
+// The calling thread takes the first chunk itself, the others go to a pool
+// of workers started once by parallel_init that sleep between jobs. A
+// parallel_for issued from inside a job runs serially on the caller.
+
+#define PARALLEL_MAX_THREADS 256
+
+typedef void (*parallel_fn)(int begin, int end, int thread, void *ctx);
+
+int parallel_threads = 1;
+
+pthread_t parallel_workers[PARALLEL_MAX_THREADS];
+pthread_mutex_t parallel_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t parallel_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t parallel_done = PTHREAD_COND_INITIALIZER;
+
+// the job being run, guarded by parallel_lock
+parallel_fn parallel_job_fn;
+void *parallel_job_ctx;
+int parallel_job_count;
+int parallel_job_threads;
+long parallel_generation;
+int parallel_pending;
+bool parallel_stopping;
+
+__thread bool parallel_in_job;
+
+void parallel_pin(pthread_t handle, int thread){
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(thread % (cores < 1 ? 1 : cores) % CPU_SETSIZE, &set);
+    if (pthread_setaffinity_np(handle, sizeof(set), &set) != 0)
+        fprintf(stderr, "Could not pin thread %d\n", thread);
+}
+
+void parallel_chunk(int thread){
+    int count = parallel_job_count;
+    int threads = parallel_job_threads;
+    int begin = (long)count * thread / threads;
+    int end = (long)count * (thread + 1) / threads;
+    parallel_job_fn(begin, end, thread, parallel_job_ctx);
+}
+
+void *parallel_worker(void *arg){
+    int thread = (int)(long)arg;
+    long seen = 0;
+    parallel_in_job = true;
+
+    pthread_mutex_lock(&parallel_lock);
+    for (;;) {
+        while (parallel_generation == seen && !parallel_stopping) {
+            pthread_cond_wait(&parallel_wake, &parallel_lock);
+        }
+        if (parallel_stopping)
+            break;
+        seen = parallel_generation;
+        if (thread >= parallel_job_threads)
+            continue;
+
+        pthread_mutex_unlock(&parallel_lock);
+        parallel_chunk(thread);
+        pthread_mutex_lock(&parallel_lock);
+        if (--parallel_pending == 0)
+            pthread_cond_signal(&parallel_done);
+    }
+    pthread_mutex_unlock(&parallel_lock);
+    return NULL;
+}
+
+// threads < 1 uses every online core. With pin set thread t is bound to
+// core t (wrapping around if there are more threads than cores), the calling
+// thread included.
+void parallel_init(int threads, bool pin){
+    if (threads < 1) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores < 1 ? 1 : cores;
+    }
+    parallel_threads = threads > PARALLEL_MAX_THREADS ? PARALLEL_MAX_THREADS : threads;
+
+    if (pin)
+        parallel_pin(pthread_self(), 0);
+    for (int t = 1; t < parallel_threads; t++) {
+        if (pthread_create(&parallel_workers[t], NULL, parallel_worker, (void*)(long)t) != 0) {
+            fprintf(stderr, "Failed to start worker thread\n");
+            exit(EXIT_FAILURE);
+        }
+        if (pin)
+            parallel_pin(parallel_workers[t], t);
+    }
+    printf("%d worker threads%s\n", parallel_threads, pin ? ", pinned" : "");
+}
+
+void parallel_for(int count, parallel_fn fn, void *ctx){
+    int threads = parallel_threads < count ? parallel_threads : count;
+    if (threads <= 1 || parallel_in_job) {
+        fn(0, count, 0, ctx);
+        return;
+    }
+
+    pthread_mutex_lock(&parallel_lock);
+    parallel_job_fn = fn;
+    parallel_job_ctx = ctx;
+    parallel_job_count = count;
+    parallel_job_threads = threads;
+    parallel_pending = threads - 1;
+    parallel_generation++;
+    pthread_cond_broadcast(&parallel_wake);
+    pthread_mutex_unlock(&parallel_lock);
+
+    parallel_in_job = true;
+    parallel_chunk(0);
+    parallel_in_job = false;
+
+    pthread_mutex_lock(&parallel_lock);
+    while (parallel_pending > 0) {
+        pthread_cond_wait(&parallel_done, &parallel_lock);
+    }
+    pthread_mutex_unlock(&parallel_lock);
+}
+
+void parallel_clear(){
+    pthread_mutex_lock(&parallel_lock);
+    parallel_stopping = true;
+    pthread_cond_broadcast(&parallel_wake);
+    pthread_mutex_unlock(&parallel_lock);
+    for (int t = 1; t < parallel_threads; t++) {
+        pthread_join(parallel_workers[t], NULL);
+    }
+    parallel_threads = 1;
+}
@@ -0,0 +1,222 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Particle-mesh solver. Mass is deposited on a pm_size x pm_size mesh over the
+// unit square, the potential is the convolution of that density with the
+// Green's function of calculate_force_cpu, done with FFTs on a mesh padded to
+// twice the size so the walls are not treated as periodic. Forces are the
+// central difference gradient of the potential.
+//
+// With a split radius the Green's function only keeps the long range part,
+// erf(r / 2rs) / r, and the short range rest is left to a direct sum (p3m.c).
+
+int pm_size;
+int pm_padded;
+float pm_cell;
+float pm_split;
+
+float *pm_density;      // pm_size * pm_size
+float *pm_potential;    // pm_size * pm_size
+vectorf *pm_field;      // pm_size * pm_size
+float *pm_green;        // complex, pm_padded * pm_padded, already transformed
+float *pm_work;         // complex, pm_padded * pm_padded
+float *pm_column;       // complex, pm_padded
+float *pm_twiddles;     // complex, pm_padded / 2
+
+void *PM_alloc(size_t size){
+    void *p = calloc(1, size);
+    if (p == NULL) {
+        fprintf(stderr, "Particle mesh: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// In place radix-2 FFT of n interleaved complex values, n a power of two.
+void PM_fft(float *data, int n, int inverse){
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            float re = data[2 * i];
+            float im = data[2 * i + 1];
+            data[2 * i] = data[2 * j];
+            data[2 * i + 1] = data[2 * j + 1];
+            data[2 * j] = re;
+            data[2 * j + 1] = im;
+        }
+    }
+
+    for (int len = 2; len <= n; len <<= 1) {
+        int step = n / len;
+        for (int i = 0; i < n; i += len) {
+            for (int k = 0; k < len / 2; k++) {
+                float wr = pm_twiddles[2 * k * step];
+                float wi = inverse ? -pm_twiddles[2 * k * step + 1] : pm_twiddles[2 * k * step + 1];
+                float *a = &data[2 * (i + k)];
+                float *b = &data[2 * (i + k + len / 2)];
+                float br = b[0] * wr - b[1] * wi;
+                float bi = b[0] * wi + b[1] * wr;
+                b[0] = a[0] - br;
+                b[1] = a[1] - bi;
+                a[0] += br;
+                a[1] += bi;
+            }
+        }
+    }
+}
+
+// 2D transform of pm_work. Only the first `rows` rows hold data on the way in
+// (forward) or are needed on the way out (inverse), the rest is padding.
+void PM_fft2d(float *data, int rows, int inverse){
+    int n = pm_padded;
+
+    if (!inverse) {
+        for (int r = 0; r < rows; r++) {
+            PM_fft(&data[2 * r * n], n, 0);
+        }
+    }
+
+    for (int c = 0; c < n; c++) {
+        for (int r = 0; r < n; r++) {
+            pm_column[2 * r] = data[2 * (r * n + c)];
+            pm_column[2 * r + 1] = data[2 * (r * n + c) + 1];
+        }
+        PM_fft(pm_column, n, inverse);
+        for (int r = 0; r < n; r++) {
+            data[2 * (r * n + c)] = pm_column[2 * r];
+            data[2 * (r * n + c) + 1] = pm_column[2 * r + 1];
+        }
+    }
+
+    if (inverse) {
+        for (int r = 0; r < rows; r++) {
+            PM_fft(&data[2 * r * n], n, 1);
+        }
+    }
+}
+
+float PM_green(float dist){
+    if (pm_split == 0)
+        return dist > 0 ? -FORCE_K / dist : 0;
+    if (dist == 0)
+        return -FORCE_K / (pm_split * sqrtf(M_PI));
+    return -FORCE_K * erff(dist / (2 * pm_split)) / dist;
+}
+
+int PM_init(int mesh_size, float split_radius){
+    if (mesh_size < 2 || (mesh_size & (mesh_size - 1)) != 0) {
+        fprintf(stderr, "Mesh size must be a power of two, got %d\n", mesh_size);
+        return 1;
+    }
+
+    pm_size = mesh_size;
+    pm_padded = 2 * mesh_size;
+    pm_cell = 1.0f / mesh_size;
+    pm_split = split_radius;
+
+    size_t cells = (size_t)pm_size * pm_size;
+    size_t padded = (size_t)pm_padded * pm_padded;
+    pm_density = PM_alloc(sizeof(float) * cells);
+    pm_potential = PM_alloc(sizeof(float) * cells);
+    pm_field = PM_alloc(sizeof(vectorf) * cells);
+    pm_green = PM_alloc(sizeof(float) * 2 * padded);
+    pm_work = PM_alloc(sizeof(float) * 2 * padded);
+    pm_column = PM_alloc(sizeof(float) * 2 * pm_padded);
+    pm_twiddles = PM_alloc(sizeof(float) * pm_padded);
+
+    for (int k = 0; k < pm_padded / 2; k++) {
+        double angle = -2 * M_PI * k / pm_padded;
+        pm_twiddles[2 * k] = cos(angle);
+        pm_twiddles[2 * k + 1] = sin(angle);
+    }
+
+    // potential of a unit mass, -FORCE_K / r, with offsets past pm_size
+    // wrapped to negative distances. Without a split the self term is left
+    // at zero, it cancels out of the central difference anyway.
+    for (int r = 0; r < pm_padded; r++) {
+        for (int c = 0; c < pm_padded; c++) {
+            int dy = r < pm_size ? r : r - pm_padded;
+            int dx = c < pm_size ? c : c - pm_padded;
+            float dist = pm_cell * sqrtf((float)(dx * dx + dy * dy));
+            pm_green[2 * (r * pm_padded + c)] = PM_green(dist);
+        }
+    }
+    PM_fft2d(pm_green, pm_padded, 0);
+
+    return 0;
+}
+
+void PM_solve_potential(){
+    size_t padded = (size_t)pm_padded * pm_padded;
+    memset(pm_work, 0, sizeof(float) * 2 * padded);
+    for (int r = 0; r < pm_size; r++) {
+        for (int c = 0; c < pm_size; c++) {
+            pm_work[2 * (r * pm_padded + c)] = pm_density[r * pm_size + c];
+        }
+    }
+
+    PM_fft2d(pm_work, pm_size, 0);
+    float scale = 1.0f / padded;
+    for (size_t i = 0; i < padded; i++) {
+        float re = pm_work[2 * i] * pm_green[2 * i] - pm_work[2 * i + 1] * pm_green[2 * i + 1];
+        float im = pm_work[2 * i] * pm_green[2 * i + 1] + pm_work[2 * i + 1] * pm_green[2 * i];
+        pm_work[2 * i] = re * scale;
+        pm_work[2 * i + 1] = im * scale;
+    }
+    PM_fft2d(pm_work, pm_size, 1);
+
+    for (int r = 0; r < pm_size; r++) {
+        for (int c = 0; c < pm_size; c++) {
+            pm_potential[r * pm_size + c] = pm_work[2 * (r * pm_padded + c)];
+        }
+    }
+}
+
+void PM_solve_field(){
+    for (int r = 0; r < pm_size; r++) {
+        int up = r > 0 ? r - 1 : r;
+        int down = r < pm_size - 1 ? r + 1 : r;
+        for (int c = 0; c < pm_size; c++) {
+            int left = c > 0 ? c - 1 : c;
+            int right = c < pm_size - 1 ? c + 1 : c;
+            vectorf *f = &pm_field[r * pm_size + c];
+            f->x = -(pm_potential[r * pm_size + right] - pm_potential[r * pm_size + left])
+                / ((right - left) * pm_cell);
+            f->y = -(pm_potential[down * pm_size + c] - pm_potential[up * pm_size + c])
+                / ((down - up) * pm_cell);
+        }
+    }
+}
+
+void PM_calculate_forces(particle_store *s, mass_assignment scheme){
+    memset(pm_density, 0, sizeof(float) * pm_size * pm_size);
+    MA_deposit(scheme, s, 0, s->count, pm_size, pm_size, pm_density, NULL);
+
+    PM_solve_potential();
+    PM_solve_field();
+
+    MA_interpolate(scheme, s, pm_field, pm_size, pm_size);
+}
+
+void PM_clear(){
+    free(pm_density);
+    free(pm_potential);
+    free(pm_field);
+    free(pm_green);
+    free(pm_work);
+    free(pm_column);
+    free(pm_twiddles);
+    pm_density = NULL;
+    pm_potential = NULL;
+    pm_field = NULL;
+    pm_green = NULL;
+    pm_work = NULL;
+    pm_column = NULL;
+    pm_twiddles = NULL;
+}
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Structure of arrays particle storage shared by the engines, the integrator
+// and the renderer. Every array is PS_ALIGN aligned and padded to a multiple
+// of PS_PAD floats, one AVX-512 register, so per particle loops can run whole
+// vectors. Padding is zeroed and has no mass, so it never pulls on anything.
+
+#define PS_ALIGN 64
+#define PS_PAD 16
+
+struct particle_store_s {
+    int count;
+    int capacity;
+    float *x;
+    float *y;
+    float *vx;
+    float *vy;
+    float *m;
+    float *fx;      // forces of the last force pass
+    float *fy;
+};
+
+typedef struct particle_store_s particle_store;
+
+float *PS_alloc(int capacity){
+    float *p = aligned_alloc(PS_ALIGN, sizeof(float) * capacity);
+    if (p == NULL) {
+        fprintf(stderr, "Particle store: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(p, 0, sizeof(float) * capacity);
+    return p;
+}
+
+int PS_padded(int count){
+    return (count + PS_PAD - 1) / PS_PAD * PS_PAD;
+}
+
+int PS_init(particle_store *s, int count, float mass){
+    if (count < 1) {
+        fprintf(stderr, "Invalid particle amount: %d\n", count);
+        return 1;
+    }
+
+    s->count = count;
+    s->capacity = PS_padded(count);
+    s->x = PS_alloc(s->capacity);
+    s->y = PS_alloc(s->capacity);
+    s->vx = PS_alloc(s->capacity);
+    s->vy = PS_alloc(s->capacity);
+    s->m = PS_alloc(s->capacity);
+    s->fx = PS_alloc(s->capacity);
+    s->fy = PS_alloc(s->capacity);
+    for (int i = 0; i < count; i++) {
+        s->m[i] = mass;
+    }
+    return 0;
+}
+
+vectorf PS_position(const particle_store *s, int i){
+    vectorf p = {s->x[i], s->y[i]};
+    return p;
+}
+
+void PS_clear(particle_store *s){
+    free(s->x);
+    free(s->y);
+    free(s->vx);
+    free(s->vy);
+    free(s->m);
+    free(s->fx);
+    free(s->fy);
+    memset(s, 0, sizeof(*s));
+}
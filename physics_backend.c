@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Backends that compute the tile forces. Every backend is set up for one
+// tile hierarchy, takes the tile positions and masses of the whole
+// hierarchy, computes the level 0 forces with one of the px_kernel
+// algorithms and hands them back. PB_select either uses the one asked for
+// or, for PB_AUTO, times every backend that can start on the real grid and
+// keeps the fastest.
+
+#define PB_CALIBRATION_STEPS 3
+
+enum physics_backend_kind_e {
+    PB_AUTO,
+    PB_OPENCL,
+    PB_CPU_SIMD,
+    PB_CPU_SCALAR,
+    PB_KIND_COUNT,
+};
+
+typedef enum physics_backend_kind_e physics_backend_kind;
+
+struct physics_backend_s {
+    const char *name;
+    int (*init)(const tile_level *levels, int level_count);
+    void (*upload)(const vectorf *positions, const float *masses);
+    void (*step)(px_kernel kernel);
+    void (*download)(vectorf *forces);
+    void (*teardown)();
+};
+
+typedef struct physics_backend_s physics_backend;
+
+int pb_tile_count;
+int pb_fine_count;
+
+// the host tile arrays given to PB_select, zero-copy OpenCL runs in them
+vectorf *pb_positions;
+float *pb_masses;
+vectorf *pb_forces;
+px_kernel pb_kernel;
+
+int PB_opencl_init(const tile_level *levels, int level_count){
+    if (PX_setupCL() != 0)
+        return 1;
+    // a grid the device cannot hold leaves the tiles to the CPU backends
+    cl_int e1 = PX_allocate_gpu_buffers(pb_tile_count, level_count, (cl_float2*)pb_positions,
+            pb_masses, (cl_float2*)pb_forces);
+    if (e1 == CL_SUCCESS)
+        e1 = PX_specialize(FORCE_K, FORCE_MIN_DIST, (const cl_int4*)levels, level_count);
+    if (e1 == CL_SUCCESS)
+        e1 = PX_set_gpu_kernel_args((cl_int4*)levels, level_count);
+    if (e1 != CL_SUCCESS) {
+        fprintf(stderr, "OpenCL backend cannot take the tile grid (error %d)\n", e1);
+        PX_clearCL();
+        return 1;
+    }
+    // tuning times the real tiles, zero-copy buffers already hold them
+    if (!px_zero_copy) {
+        PX_upload((cl_float2*)pb_positions, pb_masses, pb_tile_count);
+        clWaitForEvents(px_upload_event_count, px_upload_events);
+    }
+    PX_tune(pb_kernel, pb_fine_count);
+    // tuned first, a larger symmetric block may make it fit
+    px_kernel kernel = PX_usable_kernel(pb_kernel, pb_fine_count);
+    if (kernel != pb_kernel)
+        PX_tune(kernel, pb_fine_count);
+    PX_init_helpers((const cl_int4*)levels, level_count, pb_tile_count, pb_fine_count,
+            (const cl_float2*)pb_positions, pb_masses);
+    PX_balance(kernel, pb_fine_count);
+    return 0;
+}
+
+void PB_opencl_upload(const vectorf *positions, const float *masses){
+    PX_upload((cl_float2*)positions, (cl_float*)masses, pb_tile_count);
+}
+
+void PB_opencl_step(px_kernel kernel){
+    PX_step(kernel, pb_fine_count);
+}
+
+void PB_opencl_download(vectorf *forces){
+    PX_download((cl_float*)forces, pb_fine_count);
+}
+
+int PB_simd_init(const tile_level *levels, int level_count){
+    DS_init();
+    CP_init(levels, level_count, ds_selected_isa);
+    return 0;
+}
+
+int PB_scalar_init(const tile_level *levels, int level_count){
+    CP_init(levels, level_count, DS_ISA_SCALAR);
+    return 0;
+}
+
+physics_backend pb_backends[PB_KIND_COUNT] = {
+    [PB_OPENCL] = {"opencl", PB_opencl_init, PB_opencl_upload, PB_opencl_step,
+        PB_opencl_download, PX_clearCL},
+    [PB_CPU_SIMD] = {"simd", PB_simd_init, CP_upload, CP_step, CP_download, CP_clear},
+    [PB_CPU_SCALAR] = {"scalar", PB_scalar_init, CP_upload, CP_step, CP_download, CP_clear},
+};
+
+const physics_backend *pb_active;
+physics_backend_kind pb_active_kind;
+
+int PB_parse(const char *value, physics_backend_kind *out){
+    if (strcmp(value, "auto") == 0) {
+        *out = PB_AUTO;
+        return 0;
+    }
+    for (int k = PB_AUTO + 1; k < PB_KIND_COUNT; k++) {
+        if (strcmp(value, pb_backends[k].name) == 0) {
+            *out = k;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Unknown backend: %s (expected auto, opencl, simd or scalar)\n", value);
+    return 1;
+}
+
+double PB_now(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Seconds per upload, step and download on the current tiles, after one
+// untimed run to take first use costs out.
+double PB_time(const physics_backend *b, const vectorf *positions, const float *masses,
+        vectorf *forces, px_kernel kernel){
+    b->upload(positions, masses);
+    b->step(kernel);
+    b->download(forces);
+
+    double start = PB_now();
+    for (int i = 0; i < PB_CALIBRATION_STEPS; i++) {
+        b->upload(positions, masses);
+        b->step(kernel);
+        b->download(forces);
+    }
+    return (PB_now() - start) / PB_CALIBRATION_STEPS;
+}
+
+// positions, masses and forces are the tile buffers, already filled for the
+// particles the run starts with so calibration sees the real load. A
+// backend asked for by name that cannot start falls back to PB_AUTO.
+int PB_select(physics_backend_kind kind, const tile_level *levels, int level_count,
+        vectorf *positions, float *masses, vectorf *forces, px_kernel kernel){
+    pb_positions = positions;
+    pb_masses = masses;
+    pb_forces = forces;
+    pb_kernel = kernel;
+    pb_tile_count = levels[level_count - 1].offset
+        + levels[level_count - 1].cols * levels[level_count - 1].rows;
+    pb_fine_count = levels[0].cols * levels[0].rows;
+
+    if (kind != PB_AUTO) {
+        if (pb_backends[kind].init(levels, level_count) == 0) {
+            pb_active = &pb_backends[kind];
+            pb_active_kind = kind;
+            printf("Tile backend: %s\n", pb_active->name);
+            return 0;
+        }
+        fprintf(stderr, "Backend %s unavailable, calibrating instead\n", pb_backends[kind].name);
+    }
+
+    // backends share global state, so each one is torn down before the next
+    // starts and the winner is started again at the end
+    physics_backend_kind best = PB_KIND_COUNT;
+    double best_time = 0;
+    for (int k = PB_AUTO + 1; k < PB_KIND_COUNT; k++) {
+        const physics_backend *b = &pb_backends[k];
+        if (b->init(levels, level_count) != 0)
+            continue;
+        double t = PB_time(b, positions, masses, forces, kernel);
+        b->teardown();
+        printf("Backend %s: %.3f ms per step\n", b->name, t * 1e3);
+        if (best == PB_KIND_COUNT || t < best_time) {
+            best = k;
+            best_time = t;
+        }
+    }
+
+    if (best == PB_KIND_COUNT || pb_backends[best].init(levels, level_count) != 0) {
+        fprintf(stderr, "No tile backend could start\n");
+        return 1;
+    }
+    pb_active = &pb_backends[best];
+    pb_active_kind = best;
+    printf("Tile backend: %s\n", pb_active->name);
+    return 0;
+}
+
+void PB_clear(){
+    if (pb_active != NULL)
+        pb_active->teardown();
+    pb_active = NULL;
+}
@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Tile grid stored as a mipmap style hierarchy. Level 0 is the grid particles
+// are binned into, every next level aggregates 2x2 tiles of the one below
+// until it is at most TG_TOP_SIZE tiles wide. All levels share one buffer per
+// quantity, finest first, so level 0 starts at index 0.
+
+#define TG_MAX_LEVELS 24
+#define TG_TOP_SIZE 4
+#define TG_PARTIAL_BUDGET (64 << 20)   // bytes of per-thread partial sums
+#define TG_ALIGN 4096                  // pages, so OpenCL can use the tile arrays in place
+
+// laid out like cl_int4 so it can be uploaded as is
+struct tile_level_s {
+    int cols;
+    int rows;
+    int offset;
+    int unused;
+};
+
+typedef struct tile_level_s tile_level;
+
+tile_level tile_levels[TG_MAX_LEVELS];
+int tile_level_count;
+int tile_total;
+
+float tg_tile_w;
+float tg_tile_h;
+
+vectorf *tiles;
+float *tile_masses;
+vectorf *tile_forces;
+
+// per-thread partial sums of mass and mass weighted position, one level 0
+// grid per partial
+int tg_partials;
+float *tg_partial_mass;
+vectorf *tg_partial_moment;
+
+// particles of level 0 tile k are tg_bucket_particles[tg_bucket_start[k]]
+// up to tg_bucket_start[k + 1], rebuilt by TG_bucket
+int *tg_bucket_start;
+int *tg_bucket_particles;
+int *tg_bucket_tile;
+int *tg_bucket_histogram;   // per chunk counts, turned into write cursors
+int tg_bucket_chunks;
+int tg_bucket_capacity;
+
+void *TG_alloc(size_t size){
+    size = (size + TG_ALIGN - 1) / TG_ALIGN * TG_ALIGN;
+    void *p = aligned_alloc(TG_ALIGN, size);
+    if (p != NULL)
+        memset(p, 0, size);
+    return p;
+}
+
+int TG_init(int cols, int rows){
+    if (cols < 1 || rows < 1) {
+        fprintf(stderr, "Invalid tile grid %dx%d\n", cols, rows);
+        return 1;
+    }
+
+    tile_level_count = 0;
+    long total = 0;
+    for (;;) {
+        tile_level *level = &tile_levels[tile_level_count++];
+        level->cols = cols;
+        level->rows = rows;
+        level->offset = total;
+        level->unused = 0;
+        total += (long)cols * rows;
+        if (total > INT_MAX) {
+            fprintf(stderr, "Tile grid %dx%d has too many tiles\n", tile_levels[0].cols,
+                    tile_levels[0].rows);
+            return 1;
+        }
+
+        if ((cols <= TG_TOP_SIZE && rows <= TG_TOP_SIZE) || tile_level_count == TG_MAX_LEVELS)
+            break;
+        cols = (cols + 1) / 2;
+        rows = (rows + 1) / 2;
+    }
+
+    tile_total = total;
+    tg_tile_w = 1.0 / tile_levels[0].cols;
+    tg_tile_h = 1.0 / tile_levels[0].rows;
+
+    tiles = TG_alloc(tile_total * sizeof(vectorf));
+    tile_masses = TG_alloc(tile_total * sizeof(float));
+    tile_forces = TG_alloc(tile_total * sizeof(vectorf));
+
+    int fine = tile_levels[0].cols * tile_levels[0].rows;
+    long budget = TG_PARTIAL_BUDGET / ((long)fine * (sizeof(float) + sizeof(vectorf)));
+    tg_partials = budget < 1 ? 1 : budget < parallel_threads ? budget : parallel_threads;
+    tg_partial_mass = calloc((size_t)tg_partials * fine, sizeof(float));
+    tg_partial_moment = calloc((size_t)tg_partials * fine, sizeof(vectorf));
+
+    budget = TG_PARTIAL_BUDGET / ((long)fine * sizeof(int));
+    tg_bucket_chunks = budget < 1 ? 1 : budget < parallel_threads ? budget : parallel_threads;
+    tg_bucket_start = calloc(fine + 1, sizeof(int));
+    tg_bucket_histogram = calloc((size_t)tg_bucket_chunks * fine, sizeof(int));
+
+    if (tiles == NULL || tile_masses == NULL || tile_forces == NULL
+            || tg_partial_mass == NULL || tg_partial_moment == NULL
+            || tg_bucket_start == NULL || tg_bucket_histogram == NULL) {
+        fprintf(stderr, "Tile grid: out of memory\n");
+        return 1;
+    }
+
+    printf("Tile grid %dx%d, %d levels, %d tiles\n", tile_levels[0].cols,
+            tile_levels[0].rows, tile_level_count, tile_total);
+    return 0;
+}
+
+int TG_index(int level, int row, int col){
+    return tile_levels[level].offset + row * tile_levels[level].cols + col;
+}
+
+// Same formula as NGP binning and the bucket_count kernel, so a particle on
+// a tile boundary lands in the same tile on the CPU and the GPU.
+vectori TG_find_tile(const vectorf *particle){
+    int cols = tile_levels[0].cols;
+    int rows = tile_levels[0].rows;
+    vectori coordinates;
+    coordinates.x = MA_clamp((int)(fminf(fmaxf(particle->x, 0), 1) * cols), cols);
+    coordinates.y = MA_clamp((int)(fminf(fmaxf(particle->y, 0), 1) * rows), rows);
+    return coordinates;
+}
+
+struct tg_bin_job_s {
+    const particle_store *particles;
+    int partials;
+    mass_assignment scheme;
+};
+
+typedef struct tg_bin_job_s tg_bin_job;
+
+void TG_bin_partial(int begin, int end, int thread, void *ctx){
+    tg_bin_job *job = ctx;
+    int fine = tile_levels[0].cols * tile_levels[0].rows;
+
+    for (int p = begin; p < end; p++) {
+        float *mass = &tg_partial_mass[(size_t)p * fine];
+        vectorf *moment = &tg_partial_moment[(size_t)p * fine];
+        memset(mass, 0, sizeof(float) * fine);
+        memset(moment, 0, sizeof(vectorf) * fine);
+
+        int amount = job->particles->count;
+        int first = (long)amount * p / job->partials;
+        int last = (long)amount * (p + 1) / job->partials;
+        MA_deposit(job->scheme, job->particles, first, last,
+                tile_levels[0].cols, tile_levels[0].rows, mass, moment);
+    }
+}
+
+void TG_merge_partials(int begin, int end, int thread, void *ctx){
+    tg_bin_job *job = ctx;
+    int cols = tile_levels[0].cols;
+    int fine = cols * tile_levels[0].rows;
+
+    for (int k = begin; k < end; k++) {
+        float mass = 0;
+        vectorf moment = {0, 0};
+        for (int p = 0; p < job->partials; p++) {
+            mass += tg_partial_mass[(size_t)p * fine + k];
+            vector_add(&moment, &tg_partial_moment[(size_t)p * fine + k]);
+        }
+
+        tile_masses[k] = mass;
+        if (mass > 0) {
+            vector_divide_f(&moment, mass);
+            tiles[k] = moment;
+        } else {
+            tiles[k].x = (k % cols + 0.5f) * tg_tile_w;
+            tiles[k].y = (k / cols + 0.5f) * tg_tile_h;
+        }
+    }
+}
+
+// Bins particles into level 0 with the given assignment scheme, leaving
+// every tile at the centre of the mass it received. Each partial grid sums a
+// contiguous slice of the particles and the grids are then reduced tile by
+// tile.
+void TG_bin(const particle_store *particles, mass_assignment scheme){
+    tg_bin_job job;
+    int amount = particles->count;
+    job.particles = particles;
+    job.scheme = scheme;
+    job.partials = amount < tg_partials ? (amount > 0 ? amount : 1) : tg_partials;
+
+    parallel_for(job.partials, TG_bin_partial, &job);
+    parallel_for(tile_levels[0].cols * tile_levels[0].rows, TG_merge_partials, &job);
+}
+
+struct tg_bucket_job_s {
+    const particle_store *particles;
+    int chunks;
+};
+
+typedef struct tg_bucket_job_s tg_bucket_job;
+
+void TG_bucket_range(const tg_bucket_job *job, int chunk, int *begin, int *end){
+    int amount = job->particles->count;
+    *begin = (long)amount * chunk / job->chunks;
+    *end = (long)amount * (chunk + 1) / job->chunks;
+}
+
+void TG_bucket_count(int begin, int end, int thread, void *ctx){
+    tg_bucket_job *job = ctx;
+    int fine = tile_levels[0].cols * tile_levels[0].rows;
+
+    for (int c = begin; c < end; c++) {
+        int *histogram = &tg_bucket_histogram[(size_t)c * fine];
+        memset(histogram, 0, sizeof(int) * fine);
+        int first, last;
+        TG_bucket_range(job, c, &first, &last);
+        for (int i = first; i < last; i++) {
+            vectorf p = PS_position(job->particles, i);
+            vectori t = TG_find_tile(&p);
+            int k = t.y * tile_levels[0].cols + t.x;
+            tg_bucket_tile[i] = k;
+            histogram[k]++;
+        }
+    }
+}
+
+void TG_bucket_scatter(int begin, int end, int thread, void *ctx){
+    tg_bucket_job *job = ctx;
+    int fine = tile_levels[0].cols * tile_levels[0].rows;
+
+    for (int c = begin; c < end; c++) {
+        int *cursor = &tg_bucket_histogram[(size_t)c * fine];
+        int first, last;
+        TG_bucket_range(job, c, &first, &last);
+        for (int i = first; i < last; i++) {
+            tg_bucket_particles[cursor[tg_bucket_tile[i]]++] = i;
+        }
+    }
+}
+
+void TG_reserve_buckets(int amount){
+    if (amount > tg_bucket_capacity) {
+        tg_bucket_capacity = amount;
+        tg_bucket_particles = realloc(tg_bucket_particles, sizeof(int) * amount);
+        tg_bucket_tile = realloc(tg_bucket_tile, sizeof(int) * amount);
+        if (tg_bucket_particles == NULL || tg_bucket_tile == NULL) {
+            fprintf(stderr, "Tile grid: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Counting sort of the particle indices by level 0 tile: every chunk of
+// particles counts its tiles, a prefix sum over tiles then chunks turns the
+// counts into write cursors and every chunk scatters its own particles. The
+// order inside a tile stays the store order.
+void TG_bucket(const particle_store *particles){
+    int fine = tile_levels[0].cols * tile_levels[0].rows;
+    int amount = particles->count;
+
+    TG_reserve_buckets(amount);
+
+    tg_bucket_job job;
+    job.particles = particles;
+    job.chunks = amount < tg_bucket_chunks ? (amount > 0 ? amount : 1) : tg_bucket_chunks;
+    parallel_for(job.chunks, TG_bucket_count, &job);
+
+    int total = 0;
+    for (int k = 0; k < fine; k++) {
+        tg_bucket_start[k] = total;
+        for (int c = 0; c < job.chunks; c++) {
+            int n = tg_bucket_histogram[(size_t)c * fine + k];
+            tg_bucket_histogram[(size_t)c * fine + k] = total;
+            total += n;
+        }
+    }
+    tg_bucket_start[fine] = total;
+
+    parallel_for(job.chunks, TG_bucket_scatter, &job);
+}
+
+// Fills every coarse level from level 0. Positions are mass weighted, an
+// empty tile sits at the average of its children.
+void TG_aggregate(){
+    for (int l = 1; l < tile_level_count; l++) {
+        tile_level *level = &tile_levels[l];
+        tile_level *below = &tile_levels[l - 1];
+        for (int r = 0; r < level->rows; r++) {
+            for (int c = 0; c < level->cols; c++) {
+                float mass = 0;
+                vectorf weighted = {0, 0};
+                vectorf plain = {0, 0};
+                int children = 0;
+
+                for (int cr = 2 * r; cr <= 2 * r + 1 && cr < below->rows; cr++) {
+                    for (int cc = 2 * c; cc <= 2 * c + 1 && cc < below->cols; cc++) {
+                        int k = TG_index(l - 1, cr, cc);
+                        mass += tile_masses[k];
+                        weighted.x += tiles[k].x * tile_masses[k];
+                        weighted.y += tiles[k].y * tile_masses[k];
+                        vector_add(&plain, &tiles[k]);
+                        children++;
+                    }
+                }
+
+                int k = TG_index(l, r, c);
+                tile_masses[k] = mass;
+                if (mass > 0) {
+                    vector_divide_f(&weighted, mass);
+                    tiles[k] = weighted;
+                } else {
+                    vector_divide_f(&plain, children);
+                    tiles[k] = plain;
+                }
+            }
+        }
+    }
+}
+
+void TG_clear(){
+    free(tiles);
+    free(tile_masses);
+    free(tile_forces);
+    free(tg_partial_mass);
+    free(tg_partial_moment);
+    free(tg_bucket_start);
+    free(tg_bucket_particles);
+    free(tg_bucket_tile);
+    free(tg_bucket_histogram);
+    tg_bucket_start = NULL;
+    tg_bucket_particles = NULL;
+    tg_bucket_tile = NULL;
+    tg_bucket_histogram = NULL;
+    tg_bucket_capacity = 0;
+    tg_partial_mass = NULL;
+    tg_partial_moment = NULL;
+    tiles = NULL;
+    tile_masses = NULL;
+    tile_forces = NULL;
+}
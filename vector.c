@@ -0,0 +1,38 @@
+#include <math.h>
+
+struct vector_f_s {
+    float x;
+    float y;
+};
+
+typedef struct vector_f_s vectorf;
+
+struct vector_i_s {
+    int x;
+    int y;
+};
+
+typedef struct vector_i_s vectori;
+
+float mapf(float x, float in_min, float in_max, float out_min, float out_max) {
+    return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+void vector_add(vectorf *v1, const vectorf *v2) {
+    v1->x += v2->x;
+    v1->y += v2->y;
+}
+void vector_multiply_f(vectorf *v, float f) {
+    v->x *= f;
+    v->y *= f;
+}
+void vector_divide_f(vectorf *v, float f) {
+    v->x /= f;
+    v->y /= f;
+}
+float distancePow2(const vectorf *p1, const vectorf *p2) {
+    return pow(p1->x - p2->x, 2) + pow(p1->y - p2->y, 2);
+}
+float distance(const vectorf *p1, const vectorf *p2) {
+    return sqrt(distancePow2(p1, p2));
+}